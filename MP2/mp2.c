@@ -64,37 +64,1373 @@ inline void set_timer(struct timer_list* tlist, long release_time)
 //
 // IMPLEMENTATION NOTES
 //
-//   None 
+//   The timer of a task group is periodic: every expiration releases a job 
+//   of all its threads and re-arms the timer for the next period. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void up_handler(unsigned long ptr)
+{
+  // change the state of the current task to ready since our timer expired
+  struct mp2_task_struct *mytask;
+  struct list_head *pos;
+  struct mp2_member *m;
+  unsigned long flags;
+  mytask=(struct mp2_task_struct *) ptr;
+  if(mytask != NULL && mytask->task_type == TASK_TYPE_GROUP){
+	// release a new job of every thread of the group with a full budget
+	spin_lock_irqsave(&mytask->budget_lock, flags);
+	mytask->budget = MS_TO_NS(mytask->ptime);
+	list_for_each(pos, &mytask->members)
+	{
+	  m = list_entry(pos, struct mp2_member, member_node);
+	  m->job_done = 0;
+	}
+	if(mytask->task_state != TASK_STATE_RUNNING)
+	  mytask->task_state = TASK_STATE_READY;
+	mytask->previous_time = mytask->previous_time + MS_TO_JIFF(mytask->period);
+	mod_timer(&(mytask->wakeup_timer), mytask->previous_time + MS_TO_JIFF(mytask->period));
+	spin_unlock_irqrestore(&mytask->budget_lock, flags);
+  }else if(mytask != NULL){
+	printk(KERN_INFO "Setting mytask to state ready\n");
+  	mytask->task_state = TASK_STATE_READY;
+        set_task_state(mytask->linux_task, TASK_INTERRUPTIBLE);
+	printk(KERN_INFO "Task state is %d\n", mytask->task_state);
+  }
+
+  printk(KERN_INFO "Calling our dispatch threadPID %ld\n", mytask->pid);
+  //SCHEDULE THE THREAD TO RUN (WAKE UP THE THREAD)
+  wake_up_process(dispatch_kthread);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _insert_task
+//
+// PROCESSING:
+//
+//    This funtion inserts the current task in the task list. 
+//
+// INPUTS:
+//
+//    t - the task structure to be inserted into the task list  
+//
+// RETURN:
+//
+//   None
+//
+// IMPLEMENTATION NOTES
+//
+//   This function is called by the register_task function. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _insert_task(struct mp2_task_struct* t)
+{
+  BUG_ON(t==NULL);
+  list_add_tail(&t->task_node, &mp2_task_list);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _lookup_task
+//
+// PROCESSING:
+//
+//    This funtion this function looks up the task specified by the given PID
+//    and returns the task structure to the calling function 
+//
+// INPUTS:
+//
+//    pid - the PID of the task structure that is being searched for in the 
+//          list of tasks.  
+//
+// RETURN:
+//
+//   mp2_task_struct - the task structure that corresponds to the given PID. 
+//
+// IMPLEMENTATION NOTES
+//
+//   Must be called with mp2_mutex held, since the exit notifier removes 
+//   and frees tasks.  
+//
+///////////////////////////////////////////////////////////////////////////////
+struct mp2_task_struct* _lookup_task(long pid)
+{
+  struct list_head *pos;
+  struct mp2_task_struct *p;
+  
+  list_for_each(pos, &mp2_task_list)
+  {
+    p = list_entry(pos, struct mp2_task_struct, task_node);
+    if(p->pid == pid)
+      return p;
+  }
+  
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _lookup_member
+//
+// PROCESSING:
+//
+//    This function looks up the thread specified by the given PID among the
+//    threads attached to the reservations in the task list.
+//
+// INPUTS:
+//
+//    pid   - the PID of the thread that is being searched for
+//    owner - returns the reservation the thread is attached to
+//
+// RETURN:
+//
+//   mp2_member - the member structure that corresponds to the given PID, or
+//                NULL if the thread is not attached to any reservation.
+//
+// IMPLEMENTATION NOTES
+//
+//   Must be called with mp2_mutex held.
+//
+///////////////////////////////////////////////////////////////////////////////
+struct mp2_member* _lookup_member(long pid, struct mp2_task_struct **owner)
+{
+  struct list_head *pos, *mpos;
+  struct mp2_task_struct *p;
+  struct mp2_member *m;
+
+  list_for_each(pos, &mp2_task_list)
+  {
+    p = list_entry(pos, struct mp2_task_struct, task_node);
+    list_for_each(mpos, &p->members)
+    {
+      m = list_entry(mpos, struct mp2_member, member_node);
+      if(m->pid == pid){
+        if(owner != NULL)
+          *owner = p;
+        return m;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _has_pending_work
+//
+// PROCESSING:
+//
+//    This function checks whether any thread attached to a server has 
+//    aperiodic work to do. 
+//
+// INPUTS:
+//
+//    p - the server reservation
+//
+// RETURN:
+//
+//   bool - TRUE if at least one of the attached threads is runnable
+//
+// IMPLEMENTATION NOTES
+//
+//   Attached threads block in their own event loop while they have no 
+//   request to serve, so a runnable thread is a pending aperiodic job. 
+//
+///////////////////////////////////////////////////////////////////////////////
+bool _has_pending_work(struct mp2_task_struct* p)
+{
+  struct list_head *pos;
+  struct mp2_member *m;
+
+  list_for_each(pos, &p->members)
+  {
+    m = list_entry(pos, struct mp2_member, member_node);
+    if(m->linux_task->state == TASK_RUNNING)
+      return true;
+  }
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _is_eligible
+//
+// PROCESSING:
+//
+//    This function decides whether a task can be picked by the dispatcher.
+//
+// INPUTS:
+//
+//    p - the task structure 
+//
+// RETURN:
+//
+//   bool - TRUE if the task is READY or RUNNING. A server must also have 
+//          budget left (it is SLEEPING otherwise) and pending work. 
+//
+// IMPLEMENTATION NOTES
+//
+//   None. 
+//
+///////////////////////////////////////////////////////////////////////////////
+bool _is_eligible(struct mp2_task_struct* p)
+{
+  if(p->task_state == TASK_STATE_SLEEPING)
+    return false;
+  if(p->task_type == TASK_TYPE_SERVER)
+    return _has_pending_work(p);
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _arm_budget_timer
+//
+// PROCESSING:
+//
+//    This function sets the budget timer of a server or task group.
+//
+// INPUTS:
+//
+//    p - the reservation
+//
+// RETURN:
+//
+//   None
+//
+// IMPLEMENTATION NOTES
+//
+//   While the reservation runs, the timer expires when the remaining budget
+//   would be exhausted. The timer never waits longer than SERVER_POLL_TIME so
+//   that an idle server gives the CPU back and newly arrived work is noticed.
+//   Must be called with budget_lock held.
+//
+///////////////////////////////////////////////////////////////////////////////
+void _arm_budget_timer(struct mp2_task_struct* p)
+{
+  unsigned long delay = MS_TO_JIFF(SERVER_POLL_TIME);
+  unsigned long remaining;
+
+  // a group has nothing to poll for while it does not run
+  if(p->task_type == TASK_TYPE_GROUP && p->task_state != TASK_STATE_RUNNING)
+    return;
+
+  if(p->task_state == TASK_STATE_RUNNING){
+    remaining = MS_TO_JIFF(div_u64(p->budget, NSEC_PER_MSEC));
+    if(remaining < delay)
+      delay = remaining;
+  }
+  if(delay == 0)
+    delay = 1;
+  mod_timer(&(p->budget_timer), jiffies + delay);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _close_activation
+//
+// PROCESSING:
+//
+//    This function ends the current activation of a sporadic server and 
+//    schedules the replenishment of the budget it consumed. 
+//
+// INPUTS:
+//
+//    p - the server reservation
+//
+// RETURN:
+//
+//   None
+//
+// IMPLEMENTATION NOTES
+//
+//   The consumed budget is returned one period after the activation started.
+//   The activation time is the first time consumption was observed, which is
+//   never earlier than the real start, so the server never gets more than 
+//   budget/period of the CPU and can be admitted like a periodic task. 
+//   When all replenishment slots are in use the amount is merged into the 
+//   latest one; returning budget later is always safe. 
+//   Must be called with budget_lock held.
+//
+///////////////////////////////////////////////////////////////////////////////
+void _close_activation(struct mp2_task_struct* p)
+{
+  unsigned long time;
+  int last;
+
+  if(!p->activation_open)
+    return;
+
+  time = p->activation_time + MS_TO_JIFF(p->period);
+  if(p->nr_replenish == MAX_REPLENISHMENTS){
+    last = MAX_REPLENISHMENTS - 1;
+    p->replenish[last].time = time;
+    p->replenish[last].amount += p->activation_used;
+  }else{
+    p->replenish[p->nr_replenish].time = time;
+    p->replenish[p->nr_replenish].amount = p->activation_used;
+    p->nr_replenish++;
+  }
+  p->activation_open = 0;
+  p->activation_used = 0;
+
+  if(!timer_pending(&(p->wakeup_timer)))
+    mod_timer(&(p->wakeup_timer), p->replenish[0].time);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _charge_reservation
+//
+// PROCESSING:
+//
+//    This function charges the CPU time used by the attached threads since 
+//    the last charge against the budget of a server or task group. 
+//
+// INPUTS:
+//
+//    p - the reservation
+//
+// RETURN:
+//
+//   unsigned long long - the CPU time charged (ns)
+//
+// IMPLEMENTATION NOTES
+//
+//   The CPU time is read from the scheduler statistics of every attached 
+//   thread. When the budget is exhausted the activation is closed and the 
+//   server goes to sleep until its next replenishment; a task group goes to
+//   sleep until its next job is released. 
+//   Must be called with budget_lock held.
+//
+///////////////////////////////////////////////////////////////////////////////
+unsigned long long _charge_reservation(struct mp2_task_struct* p)
+{
+  struct list_head *pos;
+  struct mp2_member *m;
+  unsigned long long runtime, used = 0;
+
+  list_for_each(pos, &p->members)
+  {
+    m = list_entry(pos, struct mp2_member, member_node);
+    runtime = m->linux_task->se.sum_exec_runtime;
+    used += runtime - m->last_runtime;
+    m->last_runtime = runtime;
+  }
+
+  if(used == 0)
+    return 0;
+
+  if(p->task_type == TASK_TYPE_SERVER){
+    if(!p->activation_open){
+      p->activation_open = 1;
+      p->activation_time = jiffies;
+    }
+    p->activation_used += used;
+  }
+
+  if(used >= p->budget){
+    printk(KERN_INFO "Reservation PID %ld exhausted its budget\n", p->pid);
+    p->budget = 0;
+    _close_activation(p);
+    p->task_state = TASK_STATE_SLEEPING;
+  }else{
+    p->budget -= used;
+  }
+  return used;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  budget_handler
+//
+// PROCESSING:
+//
+//    This function implements the budget timer handler of a server or task
+//    group; it charges the consumed budget and signals the dispatcher thread
+//    when the reservation has to be switched in or out. 
+//
+// INPUTS:
+//
+//    ptr - points to the reservation
+//
+// RETURN:
+//
+//   None
+//
+// IMPLEMENTATION NOTES
+//
+//   A running server that used no CPU since the last charge is idle, so its
+//   activation is closed. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void budget_handler(unsigned long ptr)
+{
+  struct mp2_task_struct *p;
+  unsigned long flags;
+  int wake = 0;
+
+  p = (struct mp2_task_struct *) ptr;
+  spin_lock_irqsave(&p->budget_lock, flags);
+  if(p->task_state == TASK_STATE_RUNNING && _charge_reservation(p) == 0)
+    _close_activation(p);
+
+  if(p->task_state == TASK_STATE_SLEEPING){
+    // budget exhausted, the dispatcher has to take the CPU away
+    wake = 1;
+  }else{
+    // the server went idle while running, or work arrived while waiting
+    if(p->task_type == TASK_TYPE_SERVER && 
+       _has_pending_work(p) != (p->task_state == TASK_STATE_RUNNING))
+      wake = 1;
+    _arm_budget_timer(p);
+  }
+  spin_unlock_irqrestore(&p->budget_lock, flags);
+
+  if(wake)
+    wake_up_process(dispatch_kthread);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  replenish_handler
+//
+// PROCESSING:
+//
+//    This function implements the replenishment timer handler of a server; 
+//    it returns the budget of every replenishment that is due. 
+//
+// INPUTS:
+//
+//    ptr - points to the server reservation
+//
+// RETURN:
+//
+//   None
+//
+// IMPLEMENTATION NOTES
+//
+//   The budget never grows above the processing time the server was 
+//   admitted with. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void replenish_handler(unsigned long ptr)
+{
+  struct mp2_task_struct *p;
+  unsigned long flags;
+  int i;
+
+  p = (struct mp2_task_struct *) ptr;
+  spin_lock_irqsave(&p->budget_lock, flags);
+  while(p->nr_replenish > 0 && time_after_eq(jiffies, p->replenish[0].time))
+  {
+    p->budget += p->replenish[0].amount;
+    p->nr_replenish--;
+    for(i=0; i < p->nr_replenish; i++)
+      p->replenish[i] = p->replenish[i+1];
+  }
+  if(p->budget > MS_TO_NS(p->ptime))
+    p->budget = MS_TO_NS(p->ptime);
+
+  if(p->nr_replenish > 0)
+    mod_timer(&(p->wakeup_timer), p->replenish[0].time);
+
+  if(p->budget > 0 && p->task_state == TASK_STATE_SLEEPING){
+    p->task_state = TASK_STATE_READY;
+    _arm_budget_timer(p);
+  }
+  spin_unlock_irqrestore(&p->budget_lock, flags);
+
+  wake_up_process(dispatch_kthread);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _stop_reservation
+//
+// PROCESSING:
+//
+//    This function stops the timers of a task and releases the threads 
+//    attached to it. 
+//
+// INPUTS:
+//
+//    p - the task structure 
+//
+// RETURN:
+//
+//   None
+//
+// IMPLEMENTATION NOTES
+//
+//   The budget and the pending replenishments are dropped first so that the
+//   timer handlers cannot re-arm each other while they are deleted. 
+//   Must be called with mp2_mutex held.
+//
+///////////////////////////////////////////////////////////////////////////////
+void _stop_reservation(struct mp2_task_struct* p)
+{
+  struct list_head *pos, *tmp;
+  struct mp2_member *m;
+  struct sched_param sparam;
+  unsigned long flags;
+
+  spin_lock_irqsave(&p->budget_lock, flags);
+  p->task_state = TASK_STATE_SLEEPING;
+  p->budget = 0;
+  p->activation_open = 0;
+  p->nr_replenish = 0;
+  spin_unlock_irqrestore(&p->budget_lock, flags);
+
+  del_timer_sync(&(p->budget_timer));
+  del_timer_sync(&(p->wakeup_timer));
+
+  sparam.sched_priority = 0;
+  list_for_each_safe(pos, tmp, &p->members)
+  {
+    m = list_entry(pos, struct mp2_member, member_node);
+    if(p == mp2_current_task)
+      sched_setscheduler(m->linux_task, SCHED_NORMAL, &sparam);
+    if(p->task_type == TASK_TYPE_GROUP)
+      set_cpus_allowed_ptr(m->linux_task, &m->saved_cpus);
+    list_del(pos);
+    kfree(m);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _dispatch_task
+//
+// PROCESSING:
+//
+//    This function gives the CPU to the given task. 
+//
+// INPUTS:
+//
+//    p - the task structure of the highest priority task 
+//
+// RETURN:
+//
+//   None
+//
+// IMPLEMENTATION NOTES
+//
+//   A periodic task is woken up and set to the real-time priority. The page
+//   fault counters are read when a job is dispatched for the first time. 
+//   All the threads attached to a server are set to the real-time priority,
+//   but only the ones that have work run; the others stay blocked. The 
+//   threads of a group that did not finish their job are woken up together.
+//
+///////////////////////////////////////////////////////////////////////////////
+void _dispatch_task(struct mp2_task_struct* p)
+{
+  struct list_head *pos;
+  struct mp2_member *m;
+  struct sched_param sparam;
+  unsigned long flags;
+
+  sparam.sched_priority = MAX_USER_RT_PRIO-1;
+  if(p->task_type == TASK_TYPE_PERIODIC){
+    // a new job starts, remember the fault counters
+    if(!p->job_started){
+      p->job_started = 1;
+      p->job_faults_start = p->linux_task->min_flt + p->linux_task->maj_flt;
+    }
+    p->task_state = TASK_STATE_RUNNING;
+    wake_up_process(p->linux_task);
+    sched_setscheduler(p->linux_task, SCHED_FIFO, &sparam);
+    return;
+  }
+
+  spin_lock_irqsave(&p->budget_lock, flags);
+  p->task_state = TASK_STATE_RUNNING;
+  list_for_each(pos, &p->members)
+  {
+    m = list_entry(pos, struct mp2_member, member_node);
+    m->last_runtime = m->linux_task->se.sum_exec_runtime;
+  }
+  _arm_budget_timer(p);
+  spin_unlock_irqrestore(&p->budget_lock, flags);
+
+  list_for_each(pos, &p->members)
+  {
+    m = list_entry(pos, struct mp2_member, member_node);
+    if(p->task_type == TASK_TYPE_GROUP && !m->job_done)
+      wake_up_process(m->linux_task);
+    sched_setscheduler(m->linux_task, SCHED_FIFO, &sparam);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _preempt_task
+//
+// PROCESSING:
+//
+//    This function takes the CPU away from the given task. 
+//
+// INPUTS:
+//
+//    p - the task structure of the task that was running
+//
+// RETURN:
+//
+//   None
+//
+// IMPLEMENTATION NOTES
+//
+//   The task is set to READY only if it was running. A server is charged for
+//   the time its threads ran before they are set back to SCHED_NORMAL. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _preempt_task(struct mp2_task_struct* p)
+{
+  struct list_head *pos;
+  struct mp2_member *m;
+  struct sched_param sparam;
+  unsigned long flags;
+
+  sparam.sched_priority = 0;
+  if(p->task_type == TASK_TYPE_PERIODIC){
+    if(p->task_state == TASK_STATE_RUNNING)
+      p->task_state = TASK_STATE_READY;
+    sched_setscheduler(p->linux_task, SCHED_NORMAL, &sparam);
+    return;
+  }
+
+  spin_lock_irqsave(&p->budget_lock, flags);
+  _charge_reservation(p);
+  if(p->task_state == TASK_STATE_RUNNING)
+    p->task_state = TASK_STATE_READY;
+  spin_unlock_irqrestore(&p->budget_lock, flags);
+
+  list_for_each(pos, &p->members)
+  {
+    m = list_entry(pos, struct mp2_member, member_node);
+    sched_setscheduler(m->linux_task, SCHED_NORMAL, &sparam);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _lockable_vma
+//
+// PROCESSING:
+//
+//    This function decides whether a mapping can be locked in memory. 
+//
+// INPUTS:
+//
+//    vma - the memory mapping
+//
+// RETURN:
+//
+//   bool - TRUE if the mapping is not locked yet and can be locked
+//
+// IMPLEMENTATION NOTES
+//
+//   Same rules as mlock(): I/O, PFN and huge page mappings are left alone. 
+//
+///////////////////////////////////////////////////////////////////////////////
+bool _lockable_vma(struct vm_area_struct* vma)
+{
+  if(vma->vm_flags & (VM_LOCKED | VM_SPECIAL))
+    return false;
+  if(is_vm_hugetlb_page(vma))
+    return false;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _populate_locked
+//
+// PROCESSING:
+//
+//    This function faults in and mlocks the pages of the locked mappings 
+//    of a memory map. 
+//
+// INPUTS:
+//
+//    task - the task that owns the memory map
+//    mm -   the memory map, with mmap_sem held for reading
+//
+// RETURN:
+//
+//   None
+//
+// IMPLEMENTATION NOTES
+//
+//   Same flags as __mlock_vma_pages_range(): FOLL_MLOCK moves every page to
+//   the unevictable list, and private writable mappings are faulted for 
+//   writing so that anonymous memory is really allocated. Pages that were 
+//   present already are mlocked as well. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _populate_locked(struct task_struct *task, struct mm_struct *mm)
+{
+  struct vm_area_struct *vma;
+  int gup_flags;
+
+  for(vma = mm->mmap; vma != NULL; vma = vma->vm_next)
+  {
+    if(!(vma->vm_flags & VM_LOCKED) || (vma->vm_flags & VM_SPECIAL) || is_vm_hugetlb_page(vma))
+      continue;
+    gup_flags = FOLL_TOUCH | FOLL_MLOCK;
+    if((vma->vm_flags & (VM_WRITE | VM_SHARED)) == VM_WRITE)
+      gup_flags |= FOLL_WRITE;
+    if(vma->vm_flags & (VM_READ | VM_WRITE | VM_EXEC))
+      gup_flags |= FOLL_FORCE;
+    __get_user_pages(task, mm, vma->vm_start, vma_pages(vma), gup_flags, NULL, NULL, NULL);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  lock_task_memory
+//
+// PROCESSING:
+//
+//    This function locks the current and future mappings of a registered 
+//    task in memory and prefaults its stack and heap, so that its jobs do 
+//    not take page faults. 
+//
+// INPUTS:
+//
+//    pid -   the PID of the registered task
+//    flags - REGISTER_MLOCK, optionally with REGISTER_MLOCK_STRICT
+//    depth - how much of the stack and of the heap to prefault (KB)
+//
+// RETURN:
+//
+//   int - (-1) if the task is not registered, or if REGISTER_MLOCK_STRICT 
+//          is set and the RLIMIT_MEMLOCK of the task is too low to lock all
+//          its mappings
+//	    (1) if the rlimit is too low and only the stack and heap were 
+//	        prefaulted
+//	    (0) if the mappings were locked. 
+//
+// IMPLEMENTATION NOTES
+//
+//   Only called after the task passed admission control. mlock_fixup() is
+//   static to mm/mlock.c and sys_mlockall() only acts on the caller, so the
+//   current mappings are locked by hand: every mapping that is not locked
+//   yet is marked VM_LOCKED as a whole, so no mapping has to be split, and
+//   is accounted in locked_vm. The ranges are kept in the task structure so
+//   that unlock_task_memory can undo exactly that. Future mappings get 
+//   VM_LOCKED from def_flags, as with mlockall(MCL_FUTURE), so mmap() and 
+//   brk() lock, populate and account them through the kernel's own path 
+//   and fail once RLIMIT_MEMLOCK is reached. The pages are populated after
+//   mp2_mutex is dropped, with a reference on the memory map. The stack is
+//   prefaulted below the current stack pointer of the task and the heap 
+//   from its start, both for writing. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int lock_task_memory(long pid, long flags, long depth)
+{
+  struct mp2_task_struct *p;
+  struct task_struct *task;
+  struct mm_struct *mm;
+  struct vm_area_struct *vma;
+  unsigned long lockable = 0, limit, start, end;
+  int n = 0, ret = 0;
+
+  mutex_lock(&mp2_mutex);
+  p = _lookup_task(pid);
+  if(p == NULL || p->locked != NULL || p->locked_future){
+    mutex_unlock(&mp2_mutex);
+    return -1;
+  }
+  task = p->linux_task;
+  mm = get_task_mm(task);
+  if(mm == NULL){
+    mutex_unlock(&mp2_mutex);
+    return -1;
+  }
+
+  if(depth <= 0)
+    depth = PREFAULT_DEPTH;
+  depth *= 1024;
+
+  limit = task_rlimit(task, RLIMIT_MEMLOCK);
+  if(limit != RLIM_INFINITY)
+    limit >>= PAGE_SHIFT;
+
+  down_write(&mm->mmap_sem);
+  for(vma = mm->mmap; vma != NULL; vma = vma->vm_next)
+  {
+    if(_lockable_vma(vma)){
+      lockable += vma_pages(vma);
+      n++;
+    }
+  }
+  if(limit != RLIM_INFINITY && mm->locked_vm + lockable > limit){
+    printk(KERN_INFO "RLIMIT_MEMLOCK of PID %ld is too low to lock %lu pages\n", pid, mm->locked_vm + lockable);
+    ret = (flags & REGISTER_MLOCK_STRICT) ? -1 : 1;
+  }else if(n > 0){
+    p->locked = kmalloc(n * sizeof(struct mp2_range), GFP_KERNEL);
+    if(p->locked == NULL)
+      ret = (flags & REGISTER_MLOCK_STRICT) ? -1 : 1;
+  }
+  if(p->locked != NULL){
+    for(vma = mm->mmap; vma != NULL; vma = vma->vm_next)
+    {
+      if(_lockable_vma(vma)){
+        vma->vm_flags |= VM_LOCKED;
+        mm->locked_vm += vma_pages(vma);
+        p->locked[p->nr_locked].start = vma->vm_start;
+        p->locked[p->nr_locked].end = vma->vm_end;
+        p->nr_locked++;
+      }
+    }
+  }
+  // lock the mappings created from now on, unless the task did already
+  if(ret == 0 && !(mm->def_flags & VM_LOCKED)){
+    mm->def_flags |= VM_LOCKED;
+    p->locked_future = 1;
+  }
+  downgrade_write(&mm->mmap_sem);
+  mutex_unlock(&mp2_mutex);
+
+  if(ret < 0){
+    up_read(&mm->mmap_sem);
+    mmput(mm);
+    return ret;
+  }
+  if(ret == 0)
+    _populate_locked(task, mm);
+
+  // prefault the stack below the stack pointer
+  end = KSTK_ESP(task) & PAGE_MASK;
+  start = (end > depth) ? end - depth : 0;
+  vma = find_vma(mm, end);
+  if(vma != NULL && vma->vm_start <= end){
+    if(start < vma->vm_start && !(vma->vm_flags & VM_GROWSDOWN))
+      start = vma->vm_start;
+    get_user_pages(task, mm, start, ((end - start) >> PAGE_SHIFT) + 1, 1, 0, NULL, NULL);
+  }
+
+  // prefault the heap
+  start = mm->start_brk & PAGE_MASK;
+  end = mm->start_brk + depth;
+  if(end > mm->brk)
+    end = mm->brk;
+  if(end > start)
+    get_user_pages(task, mm, start, PAGE_ALIGN(end - start) >> PAGE_SHIFT, 1, 0, NULL, NULL);
+
+  up_read(&mm->mmap_sem);
+  mmput(mm);
+
+  if(ret == 0)
+    printk(KERN_INFO "Locked the memory of PID %ld (%lu pages)\n", pid, lockable);
+  else
+    printk(KERN_INFO "Prefaulted the memory of PID %ld without locking it\n", pid);
+  return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  unlock_task_memory
+//
+// PROCESSING:
+//
+//    This function undoes lock_task_memory when a task is removed. 
+//
+// INPUTS:
+//
+//    p - the task
+//
+// RETURN:
+//
+//   None
+//
+// IMPLEMENTATION NOTES
+//
+//   Only the mappings that lock_task_memory marked, and that are still 
+//   whole and locked, lose VM_LOCKED and are taken out of locked_vm; a 
+//   mapping the task locked itself is left alone. VM_LOCKED is taken out 
+//   of def_flags if lock_task_memory put it there, so no new mapping is 
+//   locked; the mappings created in between were locked by the kernel and
+//   stay locked until they are unmapped. 
+//   When the task exits, exit_mmap munlocks every locked mapping anyway. 
+//   The pages of the unmarked mappings stay on the unevictable list until
+//   they are unmapped, since munlock_vma_pages_range() is not exported to
+//   modules; unregistering a live task is the rare case. 
+//   Must be called with mp2_mutex held.
+//
+///////////////////////////////////////////////////////////////////////////////
+void unlock_task_memory(struct mp2_task_struct* p)
+{
+  struct mm_struct *mm;
+  struct vm_area_struct *vma;
+  int i;
+
+  if(p->locked == NULL && !p->locked_future)
+    return;
+  mm = get_task_mm(p->linux_task);
+  if(mm != NULL){
+    down_write(&mm->mmap_sem);
+    if(p->locked_future)
+      mm->def_flags &= ~VM_LOCKED;
+    for(i = 0; i < p->nr_locked; i++)
+    {
+      for(vma = find_vma(mm, p->locked[i].start); vma != NULL && vma->vm_start < p->locked[i].end; vma = vma->vm_next)
+      {
+        if((vma->vm_flags & VM_LOCKED) && vma->vm_start >= p->locked[i].start && vma->vm_end <= p->locked[i].end){
+          vma->vm_flags &= ~VM_LOCKED;
+          mm->locked_vm -= vma_pages(vma);
+        }
+      }
+    }
+    up_write(&mm->mmap_sem);
+    mmput(mm);
+  }
+  kfree(p->locked);
+  p->locked = NULL;
+  p->nr_locked = 0;
+  p->locked_future = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  should_admit
+//
+// PROCESSING:
+//
+//    This function implements the admission control 
+//
+// INPUTS:
+//
+//    period -		the time from when a job begins executing until the time the
+//			next job starts running 
+//    processing time - the total time it takes for a single job to run 
+//
+// RETURN:
+//
+//   bool - TRUE if the function should be admitted (the current task can be 
+//          scheduled without missing any deadline according to the utilization 
+//          bound-based method). 
+//          FALSE if the function should not be admitted (the current task cannot
+//          be scheduled without missing any deadline according to the utilization 
+//          bound-based method)
+//
+// IMPLEMENTATION NOTES
+//
+//   The admission criteria is based on the utilization bound-based method: 
+//   the method establishes that a task is schedulable if the sum of the processing 
+//   time of all tasks in system divided by the period of all tasks in the system
+//   is less than 0.693. 
+//
+///////////////////////////////////////////////////////////////////////////////
+bool should_admit(long period, long processingTime)
+{
+  long admissionThreshold = 693; //normalized by multiplying by 1000
+  struct list_head *pos;
+  struct mp2_task_struct *p;
+  long summation = 0;
+
+  summation = summation + PROCESSING_TIME_RATIO(processingTime, period);
+
+  list_for_each(pos, &mp2_task_list)
+  {
+    p = list_entry(pos, struct mp2_task_struct, task_node);
+    summation = summation + PROCESSING_TIME_RATIO(p->ptime, p->period);    
+  }
+
+  if(summation <= admissionThreshold)
+    return true;
+  else
+    return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _add_member
+//
+// PROCESSING:
+//
+//    This function adds a thread to a server or task group. 
+//
+// INPUTS:
+//
+//    p - the reservation
+//    m - the thread, with its PID and task_struct set
+//
+// RETURN:
+//
+//   None
+//
+// IMPLEMENTATION NOTES
+//
+//   The threads of a group are pinned round-robin to the online CPUs so 
+//   that a job runs in parallel; their affinity is restored when they leave
+//   the group. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _add_member(struct mp2_task_struct* p, struct mp2_member* m)
+{
+  unsigned long flags;
+  int cpu, n;
+
+  m->last_runtime = m->linux_task->se.sum_exec_runtime;
+  m->job_done = 0;
+  cpumask_copy(&m->saved_cpus, &m->linux_task->cpus_allowed);
+  if(p->task_type == TASK_TYPE_GROUP && num_online_cpus() > 1){
+    n = p->next_cpu++ % num_online_cpus();
+    for_each_online_cpu(cpu)
+    {
+      if(n-- == 0)
+        break;
+    }
+    set_cpus_allowed_ptr(m->linux_task, cpumask_of(cpu));
+  }
+
+  spin_lock_irqsave(&p->budget_lock, flags);
+  list_add_tail(&m->member_node, &p->members);
+  spin_unlock_irqrestore(&p->budget_lock, flags);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _elastic_adjust
+//
+// PROCESSING:
+//
+//    This function implements the elastic task model; it compresses the 
+//    utilization of the elastic tasks so that the task set fits under the 
+//    admission threshold, and relaxes it again when load drops. 
+//
+// INPUTS:
+//
+//    None.
+//
+// RETURN:
+//
+//   bool - TRUE if the periods of the elastic tasks could be set so that 
+//          the task set is schedulable, FALSE otherwise (no period changes). 
+//
+// IMPLEMENTATION NOTES
+//
+//   Rigid tasks keep their period. Every elastic task starts at its nominal
+//   utilization and gives up a share of the excess utilization proportional
+//   to its elastic coefficient. A task that would go below the utilization 
+//   of its longest period is saturated there and the excess is distributed
+//   again among the others. The new periods are rounded up, so the 
+//   utilization of the task set never exceeds what was computed. 
+//   Must be called with mp2_mutex held.
+//
+///////////////////////////////////////////////////////////////////////////////
+bool _elastic_adjust(void)
+{
+  long admissionThreshold = 693; //normalized by multiplying by 1000
+  struct list_head *pos;
+  struct mp2_task_struct *p;
+  long fixed = 0, minimum = 0, saturated, nominal, elasticity, excess;
+  long unsigned period;
+  int done;
+
+  list_for_each(pos, &mp2_task_list)
+  {
+    p = list_entry(pos, struct mp2_task_struct, task_node);
+    if(p->elasticity == 0){
+      fixed += PROCESSING_TIME_RATIO(p->ptime, p->period);
+    }else{
+      minimum += PROCESSING_TIME_RATIO(p->ptime, p->period_max);
+      p->elastic_util = PROCESSING_TIME_RATIO(p->ptime, p->period_min);
+      p->elastic_saturated = 0;
+    }
+  }
+
+  // not even the longest periods fit
+  if(fixed + minimum > admissionThreshold)
+    return false;
+
+  do {
+    done = 1;
+    saturated = 0;
+    nominal = 0;
+    elasticity = 0;
+    list_for_each(pos, &mp2_task_list)
+    {
+      p = list_entry(pos, struct mp2_task_struct, task_node);
+      if(p->elasticity == 0)
+        continue;
+      if(p->elastic_saturated){
+        saturated += p->elastic_util;
+      }else{
+        nominal += PROCESSING_TIME_RATIO(p->ptime, p->period_min);
+        elasticity += p->elasticity;
+      }
+    }
+
+    excess = fixed + saturated + nominal - admissionThreshold;
+    if(excess <= 0)
+      break;
+
+    list_for_each(pos, &mp2_task_list)
+    {
+      p = list_entry(pos, struct mp2_task_struct, task_node);
+      if(p->elasticity == 0 || p->elastic_saturated)
+        continue;
+      p->elastic_util = PROCESSING_TIME_RATIO(p->ptime, p->period_min) - 
+                        (excess * p->elasticity + elasticity - 1) / elasticity;
+      if(p->elastic_util <= (long) PROCESSING_TIME_RATIO(p->ptime, p->period_max)){
+        p->elastic_util = PROCESSING_TIME_RATIO(p->ptime, p->period_max);
+        p->elastic_saturated = 1;
+        done = 0;
+      }
+    }
+  } while(!done);
+
+  // notify the elastic tasks of their new period
+  list_for_each(pos, &mp2_task_list)
+  {
+    p = list_entry(pos, struct mp2_task_struct, task_node);
+    if(p->elasticity == 0)
+      continue;
+    if(p->elastic_util <= 0)
+      period = p->period_max;
+    else
+      period = (p->ptime * 1000 + p->elastic_util - 1) / p->elastic_util;
+    if(period < p->period_min)
+      period = p->period_min;
+    if(period > p->period_max)
+      period = p->period_max;
+    if(period != p->period){
+      printk(KERN_INFO "Elastic PID %ld period changed from %ld to %ld\n", p->pid, p->period, period);
+      p->period = period;
+    }
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  register_task
+//
+// PROCESSING:
+//
+//    This funtion implements the task registration
+//
+// INPUTS:
+//
+//    pid - 		the process ID of the calling task
+//    period -		the time from when a job of the calling task begins 
+//			executing until the time the next job of the calling task
+//			starts running 
+//    processing time - the total time it takes for a single job to run of the 
+//			calling task to run (the budget of a server)
+//    period max -	the longest period an elastic task accepts
+//    elasticity -	the elastic coefficient, 0 for a rigid task
+//    type -		TASK_TYPE_PERIODIC, TASK_TYPE_SERVER or TASK_TYPE_GROUP
+//
+// RETURN:
+//
+//   int - (-1) if there is no task associated with the given PID
+//	    (-ENOMEM) if the task structure cannot be allocated
+//	    (0) if the task is registered successfully. 
+//
+// IMPLEMENTATION NOTES
+//
+//   The register_task function calls admission control before registering
+//   the specified task in order to verify that it's schedulable. If the task
+//   passes admission control, then the register_task function allocates enough
+//   memory for it, initializes the task structure variables, sets the task 
+//   state to TASK_INTERRUPTIBLE (SLEEPING), initializes the timer, and 
+//   inserts the task into the task list. 
+//   A sporadic server is admitted like a periodic task with its budget as 
+//   the processing time. It starts READY with a full budget, and the calling
+//   task is the first thread attached to it. A task group is admitted the 
+//   same way; its first job is released one period after its first yield. 
+//   When the task does not pass admission control, the periods of the 
+//   elastic tasks (including the new one) are compressed to make room for 
+//   it; the task is only rejected when that is not enough. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int register_task(long pid, long period, long processingTime, long periodMax, long elasticity, int type)
+{
+  struct mp2_task_struct *p;
+  struct mp2_member *m, *n;
+  bool admitted;
+  
+  p = kmalloc(sizeof(struct mp2_task_struct), GFP_KERNEL);
+  if(p == NULL)
+    return -ENOMEM;
+
+  // get the task by given PID
+  p->linux_task = find_task_by_pid(pid);
+  if(p->linux_task == NULL){
+    // no task was found associated with given PID
+    printk(KERN_INFO "No task associated with PID %ld\n", pid);
+    // free the memory
+    kfree(p);
+    // return error
+    return -1;
+  }
+
+  // Update the task structure
+  p->pid = pid;
+  p->period = period;
+  p->ptime = processingTime;
+  p->period_min = period;
+  p->period_max = (periodMax > period) ? periodMax : period;
+  p->elasticity = (p->period_max > p->period_min && elasticity > 0) ? elasticity : 0;
+  p->task_state = TASK_STATE_SLEEPING;
+  p->first_yield_call = 0;
+  p->task_type = type;
+  p->job_started = 0;
+  p->jobs = 0;
+  p->faulty_jobs = 0;
+  p->job_faults = 0;
+  p->max_job_faults = 0;
+  p->locked = NULL;
+  p->nr_locked = 0;
+  p->locked_future = 0;
+  init_timer(&(p->wakeup_timer));
+  (p->wakeup_timer).function=up_handler;
+  (p->wakeup_timer).data=(unsigned long) p;
+  INIT_LIST_HEAD(&p->members);
+  spin_lock_init(&p->budget_lock);
+  init_timer(&(p->budget_timer));
+  (p->budget_timer).function=budget_handler;
+  (p->budget_timer).data=(unsigned long) p;
+  p->budget = 0;
+  p->activation_open = 0;
+  p->activation_used = 0;
+  p->nr_replenish = 0;
+
+  p->next_cpu = 0;
+
+  if(type != TASK_TYPE_PERIODIC){
+    m = kmalloc(sizeof(struct mp2_member), GFP_KERNEL);
+    if(m == NULL){
+      kfree(p);
+      return -ENOMEM;
+    }
+    m->pid = pid;
+    m->linux_task = p->linux_task;
+    _add_member(p, m);
+    p->budget = MS_TO_NS(processingTime);
+  }
+  if(type == TASK_TYPE_SERVER){
+    (p->wakeup_timer).function=replenish_handler;
+    p->task_state = TASK_STATE_READY;
+  }
+
+  // Insert the task into the task list 
+  mutex_lock(&mp2_mutex);
+  //only add if PID doesn't already exist, then admission control
+  if(_lookup_task(pid) != NULL){
+    printk(KERN_INFO "PID %ld is already registered\n", pid);
+    admitted = false;
+  }else{
+    admitted = should_admit(period, processingTime);
+    _insert_task(p);
+    if(!admitted && !_elastic_adjust()){
+      printk(KERN_INFO "PID %ld did not pass admission control\n", pid);
+      list_del(&p->task_node);
+    }else
+      admitted = true;
+  }
+  if(!admitted){
+    mutex_unlock(&mp2_mutex);
+    list_for_each_entry_safe(m, n, &p->members, member_node)
+    {
+      set_cpus_allowed_ptr(m->linux_task, &m->saved_cpus);
+      kfree(m);
+    }
+    kfree(p);
+    return -1;
+  }
+  if(type == TASK_TYPE_SERVER)
+    _arm_budget_timer(p);
+  mutex_unlock(&mp2_mutex);
+  printk(KERN_INFO "Task added to list\n");
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  attach_task
+//
+// PROCESSING:
+//
+//    This funtion attaches a thread to a sporadic server so that its 
+//    aperiodic work is served from the budget of the server, or to a task 
+//    group so that it runs the jobs of the group with the other threads.
+//
+// INPUTS:
+//
+//    server_pid - the PID the server or group was registered with
+//    pid -	   the PID of the thread to attach
+//
+// RETURN:
+//
+//   int - (-1) if there is no such server, group or thread, or if the 
+//	    thread is already registered
+//	    (-ENOMEM) if the member cannot be allocated
+//	    (0) if the thread is attached successfully. 
+//
+// IMPLEMENTATION NOTES
+//
+//   Any number of threads can be attached to the same reservation; 
+//   attaching does not change the utilization used for admission control. 
 //
 ///////////////////////////////////////////////////////////////////////////////
-void up_handler(unsigned long ptr)
+int attach_task(long server_pid, long pid)
 {
-  // change the state of the current task to ready since our timer expired
-  struct mp2_task_struct *mytask;
-  mytask=(struct mp2_task_struct *) ptr;
-  if(mytask != NULL){
-	printk(KERN_INFO "Setting mytask to state ready\n");
-  	mytask->task_state = TASK_STATE_READY;
-        set_task_state(mytask->linux_task, TASK_INTERRUPTIBLE);
-	printk(KERN_INFO "Task state is %d\n", mytask->task_state);
+  struct mp2_task_struct *p;
+  struct mp2_member *m;
+  struct sched_param sparam;
+
+  mutex_lock(&mp2_mutex);
+  p = _lookup_task(server_pid);
+  if(p == NULL || p->task_type == TASK_TYPE_PERIODIC || 
+     _lookup_task(pid) != NULL || _lookup_member(pid, NULL) != NULL){
+    mutex_unlock(&mp2_mutex);
+    return -1;
   }
 
-  printk(KERN_INFO "Calling our dispatch threadPID %ld\n", mytask->pid);
-  //SCHEDULE THE THREAD TO RUN (WAKE UP THE THREAD)
-  wake_up_process(dispatch_kthread);
+  m = kmalloc(sizeof(struct mp2_member), GFP_KERNEL);
+  if(m == NULL){
+    mutex_unlock(&mp2_mutex);
+    return -ENOMEM;
+  }
+  m->linux_task = find_task_by_pid(pid);
+  if(m->linux_task == NULL){
+    printk(KERN_INFO "No task associated with PID %ld\n", pid);
+    mutex_unlock(&mp2_mutex);
+    kfree(m);
+    return -1;
+  }
+  m->pid = pid;
+  _add_member(p, m);
+
+  // the reservation is being served right now, the new thread joins it
+  if(p == mp2_current_task){
+    sparam.sched_priority = MAX_USER_RT_PRIO-1;
+    sched_setscheduler(m->linux_task, SCHED_FIFO, &sparam);
+  }
+  mutex_unlock(&mp2_mutex);
+
+  printk(KERN_INFO "PID %ld attached to PID %ld\n", pid, server_pid);
+  return 0;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// FUNCTION NAME:  _insert_task
+// FUNCTION NAME:  _detach_member
 //
 // PROCESSING:
 //
-//    This funtion inserts the current task in the task list. 
+//    This funtion detaches a thread from the reservation it is attached to.
 //
 // INPUTS:
 //
-//    t - the task structure to be inserted into the task list  
+//    p - the reservation
+//    m - the attached thread
 //
 // RETURN:
 //
@@ -102,231 +1438,232 @@ void up_handler(unsigned long ptr)
 //
 // IMPLEMENTATION NOTES
 //
-//   This function is called by the register_task function. 
+//   Must be called with mp2_mutex held.
 //
 ///////////////////////////////////////////////////////////////////////////////
-void _insert_task(struct mp2_task_struct* t)
+void _detach_member(struct mp2_task_struct* p, struct mp2_member* m)
 {
-  BUG_ON(t==NULL);
-  list_add_tail(&t->task_node, &mp2_task_list);
+  struct sched_param sparam;
+  unsigned long flags;
+
+  spin_lock_irqsave(&p->budget_lock, flags);
+  list_del(&m->member_node);
+  spin_unlock_irqrestore(&p->budget_lock, flags);
+
+  if(p == mp2_current_task){
+    sparam.sched_priority = 0;
+    sched_setscheduler(m->linux_task, SCHED_NORMAL, &sparam);
+  }
+  if(p->task_type == TASK_TYPE_GROUP)
+    set_cpus_allowed_ptr(m->linux_task, &m->saved_cpus);
+  printk(KERN_INFO "PID %ld detached from PID %ld\n", m->pid, p->pid);
+  kfree(m);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// FUNCTION NAME:  _lookup_task
+// FUNCTION NAME:  _remove_task
 //
 // PROCESSING:
 //
-//    This funtion this function looks up the task specified by the given PID
-//    and returns the task structure to the calling function 
+//    This funtion removes a task from the task list and frees it.
 //
 // INPUTS:
 //
-//    pid - the PID of the task structure that is being searched for in the 
-//          list of tasks.  
+//    p - the task structure to be removed
 //
 // RETURN:
 //
-//   mp2_task_struct - the task structure that corresponds to the given PID. 
+//   None
 //
 // IMPLEMENTATION NOTES
 //
-//   None.  
+//   Must be called with mp2_mutex held.
 //
 ///////////////////////////////////////////////////////////////////////////////
-struct mp2_task_struct* _lookup_task(long pid)
+void _remove_task(struct mp2_task_struct* p)
 {
-  struct list_head *pos;
-  struct mp2_task_struct *p;
-  
-  list_for_each(pos, &mp2_task_list)
-  {
-    p = list_entry(pos, struct mp2_task_struct, task_node);
-    if(p->pid == pid)
-      return p;
-  }
-  
-  return NULL;
+  // remove the timers
+  _stop_reservation(p);
+  if(p == mp2_current_task)
+    mp2_current_task = NULL;
+  list_del(&p->task_node);
+  unlock_task_memory(p);
+  kfree(p);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// FUNCTION NAME:  should_admit
+// FUNCTION NAME:  unregister_task
 //
 // PROCESSING:
 //
-//    This function implements the admission control 
+//    This funtion implements the task de-registration
 //
 // INPUTS:
 //
-//    period -		the time from when a job begins executing until the time the
-//			next job starts running 
-//    processing time - the total time it takes for a single job to run 
+//    pid - the process ID of the calling task
 //
 // RETURN:
 //
-//   bool - TRUE if the function should be admitted (the current task can be 
-//          scheduled without missing any deadline according to the utilization 
-//          bound-based method). 
-//          FALSE if the function should not be admitted (the current task cannot
-//          be scheduled without missing any deadline according to the utilization 
-//          bound-based method)
+//   int - (-1) if there is no task associated with the given PID
+//	   (0) if the task is registered successfully. 
 //
 // IMPLEMENTATION NOTES
 //
-//   The admission criteria is based on the utilization bound-based method: 
-//   the method establishes that a task is schedulable if the sum of the processing 
-//   time of all tasks in system divided by the period of all tasks in the system
-//   is less than 0.693. 
+//   The unregister_task function uses the Linux kernel linked-list
+//   API to search for a given task. If the task is found in the list, the 
+//   memory is freed and the node is removed from the task list, all under
+//   mp2_mutex. 
+//   A PID that is only attached to a server is detached from it. 
 //
 ///////////////////////////////////////////////////////////////////////////////
-bool should_admit(long period, long processingTime)
+int unregister_task(long pid)
 {
-  long admissionThreshold = 693; //normalized by multiplying by 1000
-  struct list_head *pos;
   struct mp2_task_struct *p;
-  long summation = 0;
-
-  summation = summation + PROCESSING_TIME_RATIO(processingTime, period);
+  struct mp2_member *m;
+  int found = -1;  // init to not found
 
-  list_for_each(pos, &mp2_task_list)
-  {
-    p = list_entry(pos, struct mp2_task_struct, task_node);
-    summation = summation + PROCESSING_TIME_RATIO(p->ptime, p->period);    
+  // the exit notifier removes tasks too, so the lookup and the removal 
+  // are done under the mutex
+  mutex_lock(&mp2_mutex);
+  p = _lookup_task(pid);
+  if(p != NULL){
+    printk(KERN_INFO "Removing PID %ld\n", pid);
+    _remove_task(p);
+    // relax the periods of the elastic tasks
+    _elastic_adjust();
+    found = 0;
+  }else{
+    m = _lookup_member(pid, &p);
+    if(m != NULL){
+      _detach_member(p, m);
+      found = 0;
+    }
   }
+  mutex_unlock(&mp2_mutex);
 
-  if(summation <= admissionThreshold)
-    return true;
-  else
-    return false;
+  // return the result status
+  return found;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// FUNCTION NAME:  register_task
+// FUNCTION NAME:  task_exit_notify
 //
 // PROCESSING:
 //
-//    This funtion implements the task registration
+//    This function is called by the kernel whenever a task exits; it removes
+//    the exiting task from the task list if it never unregistered. 
 //
 // INPUTS:
 //
-//    pid - 		the process ID of the calling task
-//    period -		the time from when a job of the calling task begins 
-//			executing until the time the next job of the calling task
-//			starts running 
-//    processing time - the total time it takes for a single job to run of the 
-//			calling task to run
+//    self - the notifier block
+//    val  - the profiling event (PROFILE_TASK_EXIT)
+//    data - the task_struct of the exiting task
 //
 // RETURN:
 //
-//   int - (-1) if there is no task associated with the given PID
-//	    (0) if the task is registered successfully. 
+//   int - NOTIFY_OK
 //
 // IMPLEMENTATION NOTES
 //
-//   The register_task function calls admission control before registering
-//   the specified task in order to verify that it's schedulable. If the task
-//   passes admission control, then the register_task function allocates enough
-//   memory for it, initializes the task structure variables, sets the task 
-//   state to TASK_INTERRUPTIBLE (SLEEPING), initializes the timer, and 
-//   inserts the task into the task list. 
+//   The task is removed before its task_struct goes away, so its timer 
+//   stops, its utilization is given back to admission control (and to the 
+//   elastic tasks) and the dispatcher never sees a dangling linux_task. A 
+//   thread attached to a reservation is only detached from it. 
 //
 ///////////////////////////////////////////////////////////////////////////////
-int register_task(long pid, long period, long processingTime)
+int task_exit_notify(struct notifier_block *self, unsigned long val, void *data)
 {
+  struct task_struct *task = (struct task_struct *) data;
+  struct list_head *pos, *tmp;
   struct mp2_task_struct *p;
-  
-  //only add if PID doesn't already exist
-  if(_lookup_task(pid) != NULL) return -1;
-  
-  //admission control
-  if(!should_admit(period, processingTime)) return -1; 
-
-  p = kmalloc(sizeof(struct mp2_task_struct), GFP_KERNEL);
-
-  // get the task by given PID
-  p->linux_task = find_task_by_pid(pid);
-  if(p->linux_task == NULL){
-    // no task was found associated with given PID
-    printk(KERN_INFO "No task associated with PID %ld\n", pid);
-    // free the memory
-    kfree(p);
-    // return error
-    return -1;
-  }
-
-  // Update the task structure
-  p->pid = pid;
-  p->period = period;
-  p->ptime = processingTime;
-  p->task_state = TASK_STATE_SLEEPING;
-  p->first_yield_call = 0;
-  init_timer(&(p->wakeup_timer));
-  (p->wakeup_timer).function=up_handler;
-  (p->wakeup_timer).data=(unsigned long) p;
-  
+  struct mp2_member *m;
+  int reaped = 0;
 
-  // Insert the task into the task list 
   mutex_lock(&mp2_mutex);
-  _insert_task(p);
+  list_for_each_safe(pos, tmp, &mp2_task_list)
+  {
+    p = list_entry(pos, struct mp2_task_struct, task_node);
+    if(p->linux_task == task){
+      printk(KERN_INFO "PID %ld exited without unregistering\n", p->pid);
+      _remove_task(p);
+      reaped = 1;
+    }
+  }
+  if(!reaped){
+    m = _lookup_member(task->pid, &p);
+    if(m != NULL && m->linux_task == task){
+      _detach_member(p, m);
+      reaped = 1;
+    }
+  }
+  if(reaped){
+    reaped_count++;
+    _elastic_adjust();
+  }
   mutex_unlock(&mp2_mutex);
-  printk(KERN_INFO "Task added to list\n");
-  return 0;
+
+  if(reaped)
+    wake_up_process(dispatch_kthread);
+  return NOTIFY_OK;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// FUNCTION NAME:  unregister_task
+// FUNCTION NAME:  _yield_member
 //
 // PROCESSING:
 //
-//    This funtion implements the task de-registration
+//    This function implements the yield of a thread of a task group. 
 //
 // INPUTS:
 //
-//    pid - the process ID of the calling task
+//    p - the task group
+//    m - the thread that finished its part of the job
 //
 // RETURN:
 //
-//   int - (-1) if there is no task associated with the given PID
-//	   (0) if the task is registered successfully. 
+//   None
 //
 // IMPLEMENTATION NOTES
 //
-//   The unregister_task function uses the Linux kernel linked-list
-//   API to search for a given task. If the task is found in the list, the 
-//   memory is freed and the node is removed from the task list. 
+//   The thread sleeps until the next job of the group is released. The job 
+//   of the group is finished when all its threads yielded. The first yield
+//   starts the periodic release timer of the group. 
+//   Must be called with mp2_mutex held.
 //
 ///////////////////////////////////////////////////////////////////////////////
-int unregister_task(long pid)
+void _yield_member(struct mp2_task_struct* p, struct mp2_member* m)
 {
-  struct list_head *pos, *tmp;
-  struct mp2_task_struct *p;
-  int found = -1;  // init to not found
-
+  struct list_head *pos;
+  struct mp2_member *other;
+  unsigned long flags;
+  int done = 1;
 
-  // loop through the list until we find our PID, then remove it
-  list_for_each_safe(pos, tmp, &mp2_task_list)
+  spin_lock_irqsave(&p->budget_lock, flags);
+  if(p->first_yield_call == 0)
   {
-    p = list_entry(pos, struct mp2_task_struct, task_node);
-    // is this is our task?
-    if(p->pid == pid){
-      printk(KERN_INFO "Found node with PID %ld\n", p->pid);
-      // yes, we need to remove this entry
-      mutex_lock(&mp2_mutex);
-      // remove the timer
-      del_timer_sync(&(p->wakeup_timer));
-      list_del(pos);
-      kfree(p);
-      mutex_unlock(&mp2_mutex);
-      printk(KERN_INFO "Removing PID %ld\n", pid);
-      found=0;
-    } // no, keep searching
+    printk(KERN_INFO "This is the first time group PID %ld is yielding\n", p->pid);
+    p->first_yield_call = 1;
+    p->previous_time = jiffies;
+    mod_timer(&(p->wakeup_timer), p->previous_time + MS_TO_JIFF(p->period));
   }
 
-  // return the result status
-  return found;
+  m->job_done = 1;
+  set_task_state(m->linux_task, TASK_UNINTERRUPTIBLE);
+  list_for_each(pos, &p->members)
+  {
+    other = list_entry(pos, struct mp2_member, member_node);
+    if(!other->job_done)
+      done = 0;
+  }
+  if(done){
+    printk(KERN_INFO "Job of group PID %ld finished\n", p->pid);
+    p->task_state = TASK_STATE_SLEEPING;
+  }
+  spin_unlock_irqrestore(&p->budget_lock, flags);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -356,23 +1693,38 @@ int unregister_task(long pid)
 ///////////////////////////////////////////////////////////////////////////////
 int yield_task(long pid)
 {
-  struct list_head *pos, *tmp;
-  struct mp2_task_struct *p = NULL;
+  struct mp2_task_struct *p;
+  struct mp2_task_struct *group;
+  struct mp2_member *m;
+  unsigned long faults;
 
-  // loop through the list until we find our PID
-  list_for_each_safe(pos, tmp, &mp2_task_list)
-  {
-    p = list_entry(pos, struct mp2_task_struct, task_node);
-    // is this is our task?
-    if(p->pid == pid)
-    {
-      printk(KERN_INFO "yield_task: Found node with PID %ld\n", p->pid);
-      break;
-    } 
+  // threads of a task group yield their part of the group job
+  mutex_lock(&mp2_mutex);
+  m = _lookup_member(pid, &group);
+  if(m != NULL && group->task_type == TASK_TYPE_GROUP){
+    _yield_member(group, m);
+    mutex_unlock(&mp2_mutex);
+    wake_up_process(dispatch_kthread);
+    return 0;
   }
- 
-  if(p != NULL && p->pid == pid)
+
+  // the task stays in the list while the mutex is held
+  p = _lookup_task(pid);
+  if(p != NULL)
   {
+    // the job is finished, count the page faults it took
+    if(p->job_started)
+    {
+      faults = p->linux_task->min_flt + p->linux_task->maj_flt - p->job_faults_start;
+      p->jobs++;
+      p->job_faults += faults;
+      if(faults > 0)
+        p->faulty_jobs++;
+      if(faults > p->max_job_faults)
+        p->max_job_faults = faults;
+      p->job_started = 0;
+    }
+
     // indicate that it's the first time we're calling yield
     if(p->first_yield_call == 0)
     {
@@ -398,6 +1750,7 @@ int yield_task(long pid)
       set_timer(&(p->wakeup_timer), p->period);
     }
   }
+  mutex_unlock(&mp2_mutex);
 
   // pre-empt the CPU to the next READY application 
   // with the highest priority
@@ -433,7 +1786,8 @@ int yield_task(long pid)
 //
 // IMPLEMENTATION NOTES
 //
-//   None.
+//   The period of an elastic task is its current period, so an elastic task
+//   reads this file to learn the period it has to run at. 
 //
 ///////////////////////////////////////////////////////////////////////////////
 int proc_registration_read(char *page, char **start, off_t off, int count, int* eof, void* data)
@@ -457,6 +1811,56 @@ int proc_registration_read(char *page, char **start, off_t off, int count, int*
   return i;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  proc_stats_read
+//
+// PROCESSING:
+//
+//    This funtion displays the counters of the module when the 
+//    /proc/mp2/stats file is read. 
+//
+// INPUTS:
+//
+//    page 	- the location into which the user data is being written 
+//    start 	- the argument that specifies when the data begins
+//    off 	- the argument that specifies where data end
+//    count 	- the maximum number of characters that can be written 
+//    eof 	- the end-of-file argument
+//    data 	- the private data to be written to the file 
+//
+// RETURN:
+//
+//   int - the number of characters written
+//
+// IMPLEMENTATION NOTES
+//
+//   One "name value" pair per line, then one line per periodic task with its
+//   PID followed by the page fault counters of its jobs as "name value" 
+//   pairs. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int proc_stats_read(char *page, char **start, off_t off, int count, int* eof, void* data)
+{
+  off_t i=0;
+  struct list_head *pos;
+  struct mp2_task_struct *p;
+
+  mutex_lock(&mp2_mutex);
+  i += sprintf(page+off+i, "reaped %lu\n", reaped_count);
+  list_for_each(pos, &mp2_task_list)
+  {
+    p = list_entry(pos, struct mp2_task_struct, task_node);
+    if(p->task_type != TASK_TYPE_PERIODIC)
+      continue;
+    i += sprintf(page+off+i, "pid %ld jobs %lu faulty_jobs %lu job_faults %lu max_job_faults %lu\n", 
+                 p->pid, p->jobs, p->faulty_jobs, p->job_faults, p->max_job_faults);
+  }
+  mutex_unlock(&mp2_mutex);
+  *eof=1;
+  return i;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // FUNCTION NAME:  proc_registration_write
@@ -481,7 +1885,20 @@ int proc_registration_read(char *page, char **start, off_t off, int count, int*
 //   The proc_registration_write function processes the message type based on 
 //   the first character. If:
 //   "R", the function calls the register_task function with the given PID,
-//        period and processing time. 
+//        period and processing time. The optional flags and prefault depth
+//        that follow are passed to lock_task_memory once the task is 
+//        admitted; with REGISTER_MLOCK_STRICT a task whose memory cannot be
+//        locked is unregistered again. 
+//   "E", the function calls the register_task function to register an 
+//        elastic task with the given PID, nominal period, processing time, 
+//        maximum period and elastic coefficient. 
+//   "S", the function calls the register_task function to register a 
+//        sporadic server with the given PID, period and budget. 
+//   "G", the function calls the register_task function to register a task
+//        group with the given PID, period and processing time shared by all
+//        the threads of the group. 
+//   "A", the function calls the attach_task function with the given server
+//        or group PID and thread PID. 
 //   "Y", the function calls the yield_task function with the given PID
 //   "D", the function calls the unregister_task function with the given PID 
 //
@@ -492,20 +1909,52 @@ int proc_registration_write(struct file *file, const char *buffer, unsigned long
   char *action;
   long pid, processingTime;
   int status;
-  long period;
+  long period, periodMax, elasticity;
+  long flags, depth;
 
   printk(KERN_INFO "Writing to proc file\n");
 
-  proc_buffer=kmalloc(count, GFP_KERNEL);
-  action=kmalloc(2, GFP_KERNEL);
+  proc_buffer=kmalloc(count+1, GFP_KERNEL);
+  action=kmalloc(count+1, GFP_KERNEL);
   status=copy_from_user(proc_buffer, buffer, count);
-  sscanf(proc_buffer, "%s %ld %ld %ld", action, &pid, &period, &processingTime);
+  proc_buffer[count]='\0';
+  periodMax = 0;
+  elasticity = 0;
+  sscanf(proc_buffer, "%s %ld %ld %ld %ld %ld", action, &pid, &period, &processingTime, &periodMax, &elasticity);
   printk(KERN_INFO "From /proc/mp2/status: %s, %ld, %ld, %ld\n", action, pid, period, processingTime); 
 
   if(strcmp(action, "R")==0){
     printk(KERN_INFO "Going to register PID %ld\n", pid);
-    // perform registration
-    register_task(pid, period, processingTime);
+    // "R <pid> <period> <processing time> [<flags> <prefault depth>]"
+    flags = 0;
+    depth = 0;
+    sscanf(proc_buffer, "%*s %*d %*d %*d %ld %ld", &flags, &depth);
+    // perform registration, then lock the memory of the admitted task
+    if(register_task(pid, period, processingTime, period, 0, TASK_TYPE_PERIODIC) == 0 &&
+       (flags & REGISTER_MLOCK) && lock_task_memory(pid, flags, depth) < 0){
+      printk(KERN_INFO "Unable to lock the memory of PID %ld\n", pid);
+      unregister_task(pid);
+    }
+  }
+  if(strcmp(action, "E")==0){
+    printk(KERN_INFO "Going to register elastic PID %ld (period %ld-%ld, elasticity %ld)\n", pid, period, periodMax, elasticity);
+    // perform elastic registration
+    register_task(pid, period, processingTime, periodMax, elasticity, TASK_TYPE_PERIODIC);
+  }
+  if(strcmp(action, "S")==0){
+    printk(KERN_INFO "Going to register server PID %ld\n", pid);
+    // perform server registration, the processing time is the budget
+    register_task(pid, period, processingTime, period, 0, TASK_TYPE_SERVER);
+  }
+  if(strcmp(action, "G")==0){
+    printk(KERN_INFO "Going to register group PID %ld\n", pid);
+    // perform group registration, the processing time is shared by the group
+    register_task(pid, period, processingTime, period, 0, TASK_TYPE_GROUP);
+  }
+  if(strcmp(action, "A")==0){
+    // "A <server or group PID> <thread PID>"
+    printk(KERN_INFO "Going to attach PID %ld to server PID %ld\n", period, pid);
+    attach_task(pid, period);
   }
   if(strcmp(action, "D")==0){
     printk(KERN_INFO "Going to un-register PID %ld\n", pid);
@@ -554,10 +2003,11 @@ void _destroy_task_list(void)
   list_for_each_safe(pos, tmp, &mp2_task_list)
     {
       p = list_entry(pos, struct mp2_task_struct, task_node);
-      //destroy timer
-      del_timer_sync(&(p->wakeup_timer));
+      //destroy timers and attached threads
+      _stop_reservation(p);
       //remove from list
       list_del(pos);
+      unlock_task_memory(p);
       printk(KERN_INFO "Destroying task associated with PID %ld\n", p->pid);
       kfree(p);
     }
@@ -581,15 +2031,18 @@ void _destroy_task_list(void)
 //
 // IMPLEMENTATION NOTES
 //
-//   
+//   The task with the shortest period among the READY and RUNNING tasks gets
+//   the CPU. A sporadic server competes with its own period, but only while 
+//   it has budget left and one of its threads has work. A task group runs 
+//   all its threads at once, each on the CPU it was pinned to. 
 //
 ///////////////////////////////////////////////////////////////////////////////
 int perform_scheduling(void *data){
   
   struct mp2_task_struct *highest_priority = NULL;
-  struct sched_param highest_prio_sparam;
   struct list_head *pos;
   struct mp2_task_struct *p;
+  struct mp2_member *m;
 
   while(1){
 
@@ -605,7 +2058,7 @@ int perform_scheduling(void *data){
     list_for_each(pos, &mp2_task_list)
     {
       p = list_entry(pos, struct mp2_task_struct, task_node);
-      if(p->task_state == TASK_STATE_READY)
+      if(_is_eligible(p))
       {
          // initialize the first task as high priority
          if(highest_priority == NULL)
@@ -617,42 +2070,38 @@ int perform_scheduling(void *data){
          }
       }
     }
-    mutex_unlock(&mp2_mutex);
 
-    if(highest_priority != NULL){
-      if(mp2_current_task != NULL){
-        if(mp2_current_task->pid != highest_priority->pid){
-          printk(KERN_INFO "New high priority process PID=%ld, context switch\n", highest_priority->pid);
-          // set higher priority process
-          highest_priority->task_state = TASK_STATE_RUNNING;
-          wake_up_process(highest_priority->linux_task);
-          highest_prio_sparam.sched_priority = MAX_USER_RT_PRIO-1;
-          sched_setscheduler(highest_priority->linux_task, SCHED_FIFO, &highest_prio_sparam);
-
-          // set lower priority process
-          //set to READY only if it was running
-          if(mp2_current_task->task_state == TASK_STATE_RUNNING)
-            mp2_current_task->task_state = TASK_STATE_READY;
-
-          struct sched_param sparam;
-          sparam.sched_priority = 0;
-          sched_setscheduler(mp2_current_task->linux_task, SCHED_NORMAL, &sparam);
-        }else{
-          printk(KERN_INFO "mp2_current_task (PID=%ld, state=%d) is EQUAL to highest_priority (PID=%ld, state=%d)\n", mp2_current_task->pid, mp2_current_task->task_state, highest_priority->pid, highest_priority->task_state);
-          mp2_current_task->task_state = TASK_STATE_RUNNING;
-          wake_up_process(mp2_current_task->linux_task);
-        }
+    if(highest_priority != mp2_current_task){
+      // set lower priority process
+      if(mp2_current_task != NULL)
+        _preempt_task(mp2_current_task);
+      // set higher priority process
+      if(highest_priority != NULL){
+        printk(KERN_INFO "New high priority process PID=%ld, context switch\n", highest_priority->pid);
+        _dispatch_task(highest_priority);
       }else{
-        printk(KERN_INFO "Current task is NULL, context switch\n");
-        mp2_current_task = highest_priority;
+        printk(KERN_INFO "Highest Priority is NULL\n");
+      }
+      mp2_current_task = highest_priority;
+    }else if(highest_priority != NULL){
+      printk(KERN_INFO "mp2_current_task (PID=%ld, state=%d) is EQUAL to highest_priority\n", mp2_current_task->pid, mp2_current_task->task_state);
+      if(mp2_current_task->task_type == TASK_TYPE_PERIODIC){
         mp2_current_task->task_state = TASK_STATE_RUNNING;
         wake_up_process(mp2_current_task->linux_task);
-        highest_prio_sparam.sched_priority = MAX_USER_RT_PRIO-1;
-        sched_setscheduler(mp2_current_task->linux_task, SCHED_FIFO, &highest_prio_sparam);
+      }else if(mp2_current_task->task_type == TASK_TYPE_GROUP){
+        // a new job of the group was released while it was running
+        list_for_each(pos, &mp2_current_task->members)
+        {
+          m = list_entry(pos, struct mp2_member, member_node);
+          if(!m->job_done)
+            wake_up_process(m->linux_task);
+        }
       }
     }else{
       printk(KERN_INFO "Highest Priority is NULL\n");
     }
+    mutex_unlock(&mp2_mutex);
+
     //put scheduler to sleep until woken up again
     set_current_state(TASK_INTERRUPTIBLE);
     schedule();
@@ -692,6 +2141,11 @@ int __init my_module_init(void)
   register_task_file=create_proc_entry("status", 0666, mp2_proc_dir);
   register_task_file->read_proc= proc_registration_read;
   register_task_file->write_proc=proc_registration_write;
+  stats_file=create_proc_entry("stats", 0444, mp2_proc_dir);
+  stats_file->read_proc= proc_stats_read;
+
+  // remove registered tasks that exit without unregistering
+  profile_event_register(PROFILE_TASK_EXIT, &task_exit_nb);
 
   dispatch_kthread = kthread_create(perform_scheduling, NULL, "kmp2");  
 
@@ -728,7 +2182,10 @@ int __init my_module_init(void)
 ///////////////////////////////////////////////////////////////////////////////
 void __exit my_module_exit(void)
 {
+  profile_event_unregister(PROFILE_TASK_EXIT, &task_exit_nb);
+
   remove_proc_entry("status", mp2_proc_dir);
+  remove_proc_entry("stats", mp2_proc_dir);
   remove_proc_entry("mp2", NULL);
   
   stop_dispatch_thread=1;
@@ -18,6 +18,12 @@
 #include <linux/timer.h>
 #include <linux/kthread.h>
 #include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/profile.h>
+#include <linux/notifier.h>
+#include <linux/mm.h>
+#include <linux/hugetlb.h>
+#include <linux/resource.h>
 #include <asm/uaccess.h>
 #include "mp2_given.h"
 
@@ -25,12 +31,50 @@
 #define MS_TO_JIFF(j) ((j * HZ) / 1000)
 #define UPDATE_TIME 5000
 
+#define MS_TO_NS(t) ((unsigned long long)(t) * NSEC_PER_MSEC)
+
 #define PROCESSING_TIME_RATIO(t, p) ((t*1000) / p)
  
 #define TASK_STATE_READY     0
 #define TASK_STATE_RUNNING   1
 #define TASK_STATE_SLEEPING  2
 
+#define TASK_TYPE_PERIODIC   0
+#define TASK_TYPE_SERVER     1
+#define TASK_TYPE_GROUP      2
+
+#define REGISTER_MLOCK        0x1	// lock the current and future mappings and prefault stack and heap
+#define REGISTER_MLOCK_STRICT 0x2	// refuse registration if memory cannot be locked
+#define PREFAULT_DEPTH        256	// default prefault depth (KB)
+
+#define SERVER_POLL_TIME     10		// ms between pending work checks of a server
+#define MAX_REPLENISHMENTS   8		// pending replenishments kept per server
+
+// THREAD SERVED BY A RESERVATION
+struct mp2_member
+{
+  long pid;
+  struct task_struct* linux_task;
+  struct list_head member_node;
+  unsigned long long last_runtime;	// sum_exec_runtime at the last charge (ns)
+  int job_done;				// the thread yielded in the current group job
+  cpumask_t saved_cpus;			// affinity before joining a group
+};
+
+// MAPPING LOCKED AT REGISTRATION
+struct mp2_range
+{
+  unsigned long start;
+  unsigned long end;
+};
+
+// BUDGET TO BE RETURNED TO A SPORADIC SERVER
+struct mp2_replenishment
+{
+  unsigned long time;			// jiffies when the budget is returned
+  unsigned long long amount;		// budget to return (ns)
+};
+
 // PROCESS CONTROL BLOCK 
 struct mp2_task_struct
 {
@@ -41,13 +85,50 @@ struct mp2_task_struct
   long unsigned period;			// period
   long unsigned ptime;			// processing time
   long previous_time;  
+  // ELASTIC TASK MODEL
+  long unsigned period_min;		// nominal period
+  long unsigned period_max;		// longest acceptable period
+  long elasticity;			// elastic coefficient, 0 for a rigid task
+  long elastic_util;			// utilization assigned by the compression
+  int elastic_saturated;
   int first_yield_call;
   int  task_state;
+  // PAGE FAULTS TAKEN BY JOBS
+  int job_started;
+  unsigned long job_faults_start;	// min_flt + maj_flt when the job was dispatched
+  unsigned long jobs;
+  unsigned long faulty_jobs;		// jobs that took at least one page fault
+  unsigned long job_faults;		// page faults taken by all jobs
+  unsigned long max_job_faults;
+  // MEMORY LOCKED AT REGISTRATION
+  struct mp2_range *locked;		// mappings marked VM_LOCKED by lock_task_memory
+  int nr_locked;
+  int locked_future;			// VM_LOCKED was added to def_flags by lock_task_memory
+  int  task_type;
+  // SPORADIC SERVER AND TASK GROUP RESERVATION
+  struct list_head members;		// threads charged against the budget
+  int next_cpu;				// spreads the threads of a group across CPUs
+  spinlock_t budget_lock;		// protects budget, members and replenishments
+  struct timer_list budget_timer;
+  unsigned long long budget;		// remaining budget (ns)
+  int activation_open;
+  unsigned long activation_time;	// jiffies when consumption was first seen
+  unsigned long long activation_used;	// budget consumed during the activation (ns)
+  struct mp2_replenishment replenish[MAX_REPLENISHMENTS];
+  int nr_replenish;
 };
 
 //PROC FILESYSTEM ENTRIES
 static struct proc_dir_entry *mp2_proc_dir;
 static struct proc_dir_entry *register_task_file;
+static struct proc_dir_entry *stats_file;
+
+// TASK EXIT NOTIFICATION
+int task_exit_notify(struct notifier_block *self, unsigned long val, void *data);
+struct notifier_block task_exit_nb = {
+    notifier_call : task_exit_notify
+};
+unsigned long reaped_count=0;		// registered tasks removed because they exited
 
 struct mp2_task_struct *mp2_current_task;
 struct task_struct* dispatch_kthread;
@@ -14,6 +14,8 @@
 #include <fcntl.h>
 #include <stdbool.h>
 
+#define REGISTER_MLOCK 0x1	// ask the module to lock and prefault our memory
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // FUNCTION NAME:  factorial
@@ -127,13 +129,14 @@ bool is_registered(pid_t pid){
 //   The try_register function uses a system call to update the /proc/mp2/status 
 //   by writing a formatted register message to the file via echo. After the call 
 //   to the kernel, the function verifies that the PID appears in the proc file 
-//   by calling is_registered. 
+//   by calling is_registered. The memory of the task is locked and prefaulted 
+//   by the module so that the jobs do not take page faults. 
 //
 ///////////////////////////////////////////////////////////////////////////////
 bool try_register(pid_t pid, long period, long processTime){
   // create the string to write to the proc file
   char action[128];
-  sprintf(action, "echo \"R %d %ld %ld\" > /proc/mp2/status", pid, period, processTime);
+  sprintf(action, "echo \"R %d %ld %ld %d 0\" > /proc/mp2/status", pid, period, processTime, REGISTER_MLOCK);
   system(action);
   
   // let's check if we are a registered process
@@ -9,103 +9,191 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <errno.h>
-
-#define NPAGES (128)   // The size of profiler buffer (Unit: memory page)
-#define BUFD_MAX 48000 // The max number of profiled samples stored in the profiler buffer
+#include <string.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include "mp3_buffer.h"
 
 static int buf_fd = -1;
 static int buf_len;
 
-// This function opens a character device (which is pointed by a file named as fname) and performs the mmap() operation. If the operations are successful, the base address of memory mapped buffer is returned. Otherwise, a NULL pointer is returned.
+// This function opens a character device (which is pointed by a file named as fname) and performs the mmap() operation. The layout page at the start of the buffer tells how large the whole buffer is. If the operations are successful, the base address of memory mapped buffer is returned. Otherwise, a NULL pointer is returned.
 void *buf_init(char *fname)
 {
-  unsigned int *kadr;
+  struct mp3_buffer_layout *layout;
+  void *kadr;
 
   if(buf_fd == -1){
-    buf_len = NPAGES * getpagesize();
     if ((buf_fd=open(fname, O_RDWR|O_SYNC))<0){
         printf("file open error. %s\n", fname);
         return NULL;
     }
   }
-  //unsigned int data[buf_len];
-  unsigned int *data;
-  int i=0;
-/*  while(i < buf_len){
-    data[i] = (unsigned int) malloc(sizeof(int));
-    i++;
-  }
-  i=0;
-  while(read(buf_fd, &data[i++], 4096));
-*/
-  data = malloc(buf_len);
-  read(buf_fd, data, buf_len);
-  
   errno=0;
-/*  kadr = mmap(0, buf_len, PROT_READ|PROT_WRITE, MAP_SHARED, buf_fd, 0);
-  if (kadr == MAP_FAILED){
+  layout = mmap(0, getpagesize(), PROT_READ, MAP_SHARED, buf_fd, 0);
+  if (layout == MAP_FAILED){
       printf("buf file open error, errno=%d.\n", errno);
       return NULL;
-  }else if(kadr < 0){
-      printf("Error code: %d\n", kadr);
+  }
+  if (layout->magic != MP3_BUFFER_MAGIC || layout->version != MP3_FORMAT_VERSION || layout->record_size != sizeof(struct mp3_record)){
+      printf("unknown buffer layout\n");
+      munmap(layout, getpagesize());
+      return NULL;
+  }
+  buf_len = layout->ring_offset + layout->nr_rings * layout->ring_size;
+  munmap(layout, getpagesize());
+
+  kadr = mmap(0, buf_len, PROT_READ|PROT_WRITE, MAP_SHARED, buf_fd, 0);
+  if (kadr == MAP_FAILED){
+      printf("buf file open error, errno=%d.\n", errno);
       return NULL;
   }
   return kadr;
-*/
-  return data;
 }
 
 // This function closes the opened character device file.
-void buf_exit()
+void buf_exit(void *buf)
 {
+  if(buf != NULL)
+    munmap(buf, buf_len);
   if(buf_fd != -1){
     close(buf_fd);
     buf_fd = -1;
   }
 }
 
-int main(int argc, char* argv[])
+// A reader position in the ring of one CPU
+struct ring_cursor
+{
+  volatile struct mp3_buffer_header *header;
+  struct mp3_record *buf;
+  unsigned long index, head;
+  struct mp3_record rec;
+  int valid;		// rec holds the next unread record
+};
+
+// This function loads the next record of a ring into its cursor, skipping the records that the profiler overwrote while they were copied.
+void ring_next(struct ring_cursor *c)
+{
+  c->valid = 0;
+  while(c->index != c->head){
+    c->rec = c->buf[c->index % c->header->capacity];
+    // The copy is only valid if the slot was not rewritten meanwhile; once the head is capacity records ahead the profiler may be writing the slot right now
+    __sync_synchronize();
+    if(c->header->policy == MP3_OVERWRITE_OLDEST && c->header->head - c->index >= c->header->capacity){
+      c->index++;
+      continue;
+    }
+    c->valid = 1;
+    return;
+  }
+}
+
+// This function prints the records that the profiler published since the last call, merging the rings by time stamp, and gives the slots back to the profiler. It returns the number of records read.
+int drain(struct mp3_buffer_layout *layout, struct ring_cursor *rings, int slot)
 {
-  long *buf;
-  int index = 0;
+  struct ring_cursor *next;
+  unsigned long r;
   int i;
 
+  // Read the head of every ring before the records it publishes
+  for(r=0; r<layout->nr_rings; r++){
+    rings[r].header = (struct mp3_buffer_header *)((char *)layout + layout->ring_offset + r * layout->ring_size);
+    rings[r].buf = (struct mp3_record *)((char *)rings[r].header + rings[r].header->data_offset);
+    rings[r].head = rings[r].header->head;
+    __sync_synchronize();
+    rings[r].index = rings[r].header->tail[slot];
+    // Skip the records that the profiler already overwrote
+    if(rings[r].head - rings[r].index >= rings[r].header->capacity)
+      rings[r].index = rings[r].head - rings[r].header->capacity;
+    ring_next(&rings[r]);
+  }
+
+  // Merge the rings by time stamp and print the profiled data in place:
+  // time pid tid min_flt maj_flt cpu_time interval
+  // time pid tid fault address ip major|minor latency
+  // time pid tid wss pages scanned pages rss pages pass duration
+  i=0;
+  for(;;){
+    next = NULL;
+    for(r=0; r<layout->nr_rings; r++){
+      if(rings[r].valid && (next == NULL || rings[r].rec.time < next->rec.time))
+        next = &rings[r];
+    }
+    if(next == NULL)
+      break;
+    if(next->rec.type == MP3_RECORD_SAMPLE)
+      printf("%llu %d %d %llu %llu %llu %llu\n", next->rec.time, next->rec.pid, next->rec.tid, next->rec.u.sample.min_flt, next->rec.u.sample.maj_flt, next->rec.u.sample.cpu_time, next->rec.u.sample.interval);
+    else if(next->rec.type == MP3_RECORD_SLICE)
+      printf("%llu %d %d slice %llu %llu %llu %llu\n", next->rec.time, next->rec.pid, next->rec.tid, next->rec.u.sample.min_flt, next->rec.u.sample.maj_flt, next->rec.u.sample.cpu_time, next->rec.u.sample.interval);
+    else if(next->rec.type == MP3_RECORD_ROLLUP)
+      printf("%llu %d %d rollup %llu %llu %llu %llu\n", next->rec.time, next->rec.pid, next->rec.tid, next->rec.u.sample.min_flt, next->rec.u.sample.maj_flt, next->rec.u.sample.cpu_time, next->rec.u.sample.interval);
+    else if(next->rec.type == MP3_RECORD_WSS)
+      printf("%llu %d %d wss %llu scanned %llu rss %llu pass %lluns\n", next->rec.time, next->rec.pid, next->rec.tid, next->rec.u.wss.pages, next->rec.u.wss.scanned, next->rec.u.wss.rss, next->rec.u.wss.duration);
+    else if(next->rec.type == MP3_RECORD_AGG)
+      printf("%llu %d %d agg count %u window %uus min_flt %u max %u maj_flt %u max %u cpu %uus max %uus\n", next->rec.time, next->rec.pid, next->rec.tid, next->rec.u.agg.count, next->rec.u.agg.window_us, next->rec.u.agg.min_flt, next->rec.u.agg.min_flt_max, next->rec.u.agg.maj_flt, next->rec.u.agg.maj_flt_max, next->rec.u.agg.cpu_us, next->rec.u.agg.cpu_us_max);
+    else if(next->rec.type == MP3_RECORD_PFF)
+      printf("%llu %d %d pff %s allowance %llu rate %llu rss %llu\n", next->rec.time, next->rec.pid, next->rec.tid, (next->rec.u.pff.decision & MP3_PFF_RAISE) ? "raise" : "trim", next->rec.u.pff.allowance, next->rec.u.pff.rate, next->rec.u.pff.rss);
+    else if(next->rec.type == MP3_RECORD_FAULT)
+      printf("%llu %d %d fault %#llx ip %#llx %s %lluns\n", next->rec.time, next->rec.pid, next->rec.tid, next->rec.u.fault.address, next->rec.u.fault.ip, (next->rec.u.fault.flags & MP3_FAULT_MAJOR) ? "major" : "minor", next->rec.u.fault.latency);
+    i++;
+    next->index++;
+    ring_next(next);
+  }
+
+  // Tell the profiler the slots can be reused
+  __sync_synchronize();
+  for(r=0; r<layout->nr_rings; r++)
+    rings[r].header->tail[slot] = rings[r].index;
+  return i;
+}
+
+// usage: monitor [-f]
+// Without arguments the records available now are printed. With -f the monitor keeps running and sleeps in poll() until the watermark of the profiler is reached.
+int main(int argc, char* argv[])
+{
+  struct mp3_buffer_layout *layout;
+  struct ring_cursor *rings;
+  struct pollfd pfd;
+  unsigned long r, lost = 0;
+  int i, follow, slot;
+
+  follow = (argc > 1 && strcmp(argv[1], "-f") == 0);
+
   // Open the char device and mmap()
-  buf = buf_init("node");
-  if(!buf)
-    return -1;
-  if(buf == NULL){
+  layout = buf_init("node");
+  if(layout == NULL){
     printf("buf is NULL\n");
     return -1;
   }
-  // Read and print profiled data
-  for(index=0; index<BUFD_MAX; index++)
-    if(buf[index] != -1) break;
-  i=0;
-  while(buf[index] != -1){
-    printf("%d ", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-
-    printf("%d ", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-
-    printf("%d ", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-
-    printf("%d\n", buf[index]);
-    buf[index++] = -1;
-    if(index >= BUFD_MAX)
-      index = 0;
-    i++;
+  // Every open file is a consumer with its own tail in the rings
+  slot = ioctl(buf_fd, MP3_IOC_CONSUMER);
+  if(slot < 0){
+    printf("no consumer slot, errno=%d\n", errno);
+    buf_exit(layout);
+    return -1;
+  }
+  rings = calloc(layout->nr_rings, sizeof(struct ring_cursor));
+  if(rings == NULL){
+    buf_exit(layout);
+    return -1;
+  }
+
+  i = drain(layout, rings, slot);
+  while(follow){
+    pfd.fd = buf_fd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      break;
+    i += drain(layout, rings, slot);
+    fflush(stdout);
   }
-  printf("read %d profiled data\n", i);
+
+  for(r=0; r<layout->nr_rings; r++)
+    lost += rings[r].header->lost[slot] + rings[r].header->drops;
+  printf("read %d profiled data (%lu lost)\n", i, lost);
   // Close the char device
-  buf_exit();
+  free(rings);
+  buf_exit(layout);
+  return 0;
 }
-
@@ -81,15 +81,2802 @@ struct mp3_task_struct* _lookup_task(long pid)
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// FUNCTION NAME:  work_handler
+// FUNCTION NAME:  _global_pid
 //
 // PROCESSING:
 //
-//    This function gets the sample information for each registered task.
+//    This function turns a PID as seen by the calling task into the PID of
+//    the initial namespace, which the tasks are registered by. 
 //
 // INPUTS:
 //
-//    arg - pointer to data of the work queue 
+//    nr - the PID in the namespace of the calling task 
+//
+// RETURN:
+//
+//   long - the global PID, or -1 if no such task is visible to the caller
+//
+// IMPLEMENTATION NOTES
+//
+//   The exit notifier and the fault probe only see task->pid, which is the
+//   global PID, so a task must be hashed by it. A PID without a task is 
+//   kept as is when the caller is in the initial namespace, so a target 
+//   whose root already exited can still be dropped. 
+//
+///////////////////////////////////////////////////////////////////////////////
+long _global_pid(long nr)
+{
+  struct task_struct *task;
+  long pid = -1;
+
+  rcu_read_lock();
+  task = find_task_by_pid(nr);
+  if(task != NULL)
+    pid = task->pid;
+  else if(task_active_pid_ns(current) == &init_pid_ns)
+    pid = nr;
+  rcu_read_unlock();
+  return pid;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _task_owned
+//
+// PROCESSING:
+//
+//    This function tells whether the calling task may change the settings
+//    of a registered task. 
+//
+// INPUTS:
+//
+//    p - the registered task
+//
+// RETURN:
+//
+//   int - 1 if the caller may act on the task, 0 otherwise
+//
+// IMPLEMENTATION NOTES
+//
+//   The rule is the one of kill(): the effective UID of the caller is the 
+//   real or effective UID of the task, or the caller has CAP_SYS_ADMIN. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int _task_owned(struct mp3_task_struct *p)
+{
+  const struct cred *cred = current_cred(), *tcred;
+  int owned;
+
+  rcu_read_lock();
+  tcred = __task_cred(p->linux_task);
+  owned = (cred->euid == tcred->euid || cred->euid == tcred->uid);
+  rcu_read_unlock();
+  return owned || capable(CAP_SYS_ADMIN);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _lookup_task_rcu
+//
+// PROCESSING:
+//
+//    This function looks up the registered task with the given PID in the
+//    task hash. 
+//
+// INPUTS:
+//
+//    pid - the PID of the task
+//
+// RETURN:
+//
+//   mp3_task_struct - the registered task, NULL if there is none
+//
+// IMPLEMENTATION NOTES
+//
+//   It does not sleep or take mp3_mutex, so it can be called from the fault
+//   path. The caller must hold rcu_read_lock; unregister_task waits for an
+//   RCU grace period before it frees a task. 
+//
+///////////////////////////////////////////////////////////////////////////////
+struct mp3_task_struct* _lookup_task_rcu(long pid)
+{
+  struct hlist_node *pos;
+  struct mp3_task_struct *p;
+
+  hlist_for_each_entry_rcu(p, pos, &mp3_task_hash[hash_long(pid, MP3_HASH_BITS)], hash_node)
+  {
+    if(p->pid == pid)
+      return p;
+  }
+  return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _sample_task
+//
+// PROCESSING:
+//
+//    This function reads the fault counters and the cpu time of a task and
+//    returns how much they grew since the last sample. 
+//
+// INPUTS:
+//
+//    p   - the registered task
+//    min - returns the minor faults in the interval
+//    maj - returns the major faults in the interval
+//    cpu - returns the cpu time used in the interval in nanoseconds
+//
+// RETURN:
+//
+//   int - (0) on success, (-1) if the task is gone
+//
+// IMPLEMENTATION NOTES
+//
+//   The counters of the task are only read, never reset, so /proc/<pid>/stat
+//   and getrusage keep working while the task is profiled; the last values
+//   seen are kept in the mp3_task_struct instead. The cpu time is the 
+//   scheduler runtime (se.sum_exec_runtime), which is kept in nanoseconds. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int _sample_task(struct mp3_task_struct *p, unsigned long *min, unsigned long *maj, unsigned long *cpu)
+{
+  struct task_struct *task;
+  unsigned long cur_min, cur_maj;
+  unsigned long long cur_runtime;
+
+  rcu_read_lock();
+  task = find_task_by_global_pid(p->pid);
+  if(task == NULL || task != p->linux_task){
+    rcu_read_unlock();
+    return -1;
+  }
+  cur_min = task->min_flt;
+  cur_maj = task->maj_flt;
+  cur_runtime = task->se.sum_exec_runtime;
+  rcu_read_unlock();
+
+  *min = cur_min - p->last_min;
+  *maj = cur_maj - p->last_maj;
+  *cpu = cur_runtime - p->last_runtime;
+  p->last_min = cur_min;
+  p->last_maj = cur_maj;
+  p->last_runtime = cur_runtime;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _ring_put
+//
+// PROCESSING:
+//
+//    This function appends one record to the ring buffer of a CPU. 
+//
+// INPUTS:
+//
+//    s   - the sampler of the CPU that owns the ring
+//    rec - the record; its type, task and payload are filled in by the
+//          caller, the rest is filled in here
+//
+// RETURN:
+//
+//   int - (0) if the record was stored, (-1) if it was dropped
+//
+// IMPLEMENTATION NOTES
+//
+//   The sampling thread of the CPU is the only producer of its ring, so head
+//   needs no lock. The slot is written before head is published (smp_wmb)
+//   so that a mmap reader never sees a new head with an old record. The 
+//   ring is full when the slowest consumer is a whole ring behind; with no
+//   consumer the ring is never full. A full ring either overwrites the 
+//   oldest record, which counts as lost for every consumer that did not 
+//   read it, or drops the new one, depending on the policy. Every record 
+//   takes a sequence number, so dropped records leave a gap. The head, 
+//   capacity and policy come from the sampler; only the tails are read 
+//   from the header page, and any value they hold stays in bounds. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int _ring_put(struct mp3_cpu_sampler *s, struct mp3_record *rec)
+{
+  struct mp3_buffer_header *header = s->header;
+  unsigned long head = s->head;
+  unsigned long consumers = ACCESS_ONCE(mp3_consumers);
+  unsigned long lag, max_lag = 0;
+  int c;
+
+  rec->size = sizeof(struct mp3_record);
+  rec->cpu = s->cpu;
+  rec->seq = s->seq++;
+  for(c = 0; c < MP3_MAX_CONSUMERS; c++){
+    if(!(consumers & (1UL << c)))
+      continue;
+    lag = head - ACCESS_ONCE(header->tail[c]);
+    if(lag > max_lag)
+      max_lag = lag;
+  }
+  if(max_lag >= s->capacity){
+    if(s->policy == MP3_DROP_NEWEST){
+      header->drops = ++s->drops;
+      return -1;
+    }
+    for(c = 0; c < MP3_MAX_CONSUMERS; c++){
+      if((consumers & (1UL << c)) && head - ACCESS_ONCE(header->tail[c]) >= s->capacity)
+        header->lost[c] = ++s->lost[c];
+    }
+  }
+  // the consumers must be done with the slot before we reuse it
+  smp_mb();
+
+  s->records[head % s->capacity] = *rec;
+
+  // publish the record to read() and to the mmap consumer
+  smp_wmb();
+  ACCESS_ONCE(s->head) = head + 1;
+  ACCESS_ONCE(header->head) = head + 1;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _drain_faults
+//
+// PROCESSING:
+//
+//    This function moves the records staged on a CPU to the ring of that 
+//    CPU. 
+//
+// INPUTS:
+//
+//    s - the sampler of the CPU
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   Called by the sampling thread of the CPU with the sampler lock held, so
+//   the ring keeps a single producer. The stage is only appended to on the
+//   CPU it belongs to, with preemption disabled, and the thread never 
+//   faults on user memory; disabling preemption here is enough to keep the
+//   two apart. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _drain_faults(struct mp3_cpu_sampler *s)
+{
+  unsigned int n;
+
+  preempt_disable();
+  for(n = 0; n < s->nr_staged; n++)
+    _ring_put(s, &s->stage[n]);
+  s->nr_staged = 0;
+  preempt_enable();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _stage_record
+//
+// PROCESSING:
+//
+//    This function stages a record on the current CPU for the sampling 
+//    thread of the CPU to move to its ring. 
+//
+// INPUTS:
+//
+//    rec - the record; its type, task, time and payload are filled in
+//
+// RETURN:
+//
+//   int - (0) if the record was staged, (-1) if the stage was full
+//
+// IMPLEMENTATION NOTES
+//
+//   For code that cannot take the sampler lock (the fault probe, the 
+//   context switch notifiers) or does not run on the sampling thread (the 
+//   controllers). Must be called with preemption disabled. The thread is 
+//   woken up when a batch is staged, or right away if the CPU has no 
+//   sampling timer running. The wake up goes through an irq_work, since 
+//   the scheduler cannot wake a task from a context switch. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int _stage_record(struct mp3_record *rec)
+{
+  struct mp3_cpu_sampler *s = &__get_cpu_var(mp3_samplers);
+
+  if(s->stage == NULL || s->thread == NULL)
+    return -1;
+  if(s->nr_staged == MP3_STAGE_SIZE){
+    s->stage_drops++;
+    return -1;
+  }
+  s->stage[s->nr_staged++] = *rec;
+
+  if(s->nr_staged >= MP3_STAGE_BATCH || !hrtimer_active(&s->timer))
+    irq_work_queue(&s->kick);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _kick_thread
+//
+// PROCESSING:
+//
+//    This function wakes up the sampling thread of a CPU to move the staged
+//    records to the ring. 
+//
+// INPUTS:
+//
+//    work - the irq_work of the sampler
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   Runs in interrupt context on the CPU that staged the records. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _kick_thread(struct irq_work *work)
+{
+  struct mp3_cpu_sampler *s = container_of(work, struct mp3_cpu_sampler, kick);
+
+  if(s->thread == NULL)
+    return;
+  s->drain = 1;
+  wake_up_process(s->thread);
+}
+
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  exact_sched_in
+//
+// PROCESSING:
+//
+//    This function is called by the scheduler when a task in exact mode 
+//    starts running on a CPU; it takes the counters of the task at the 
+//    start of the run. 
+//
+// INPUTS:
+//
+//    notifier - the preempt notifier of the task
+//    cpu      - the CPU the task runs on
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   Runs in the context of the task, so its counters need no lock. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void exact_sched_in(struct preempt_notifier *notifier, int cpu)
+{
+  struct mp3_task_struct *p = container_of(notifier, struct mp3_task_struct, notifier);
+
+  p->slice_min = current->min_flt;
+  p->slice_maj = current->maj_flt;
+  p->slice_runtime = current->se.sum_exec_runtime;
+  p->slice_start = ktime_to_ns(ktime_get());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  exact_sched_out
+//
+// PROCESSING:
+//
+//    This function is called by the scheduler when a task in exact mode 
+//    stops running; it accounts the faults and cpu time of the run to the
+//    task and stages a slice record for it. 
+//
+// INPUTS:
+//
+//    notifier - the preempt notifier of the task
+//    next     - the task that runs next
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   Called with the run queue locked and interrupts off, after the runtime
+//   of the task was brought up to date. Only this notifier updates the 
+//   counters of a task in exact mode. The sample filter of the task 
+//   applies to the slices as well. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void exact_sched_out(struct preempt_notifier *notifier, struct task_struct *next)
+{
+  struct mp3_task_struct *p = container_of(notifier, struct mp3_task_struct, notifier);
+  unsigned long min, maj, cpu;
+  struct mp3_record rec;
+
+  rec.time = ktime_to_ns(ktime_get());
+  min = current->min_flt - p->slice_min;
+  maj = current->maj_flt - p->slice_maj;
+  cpu = current->se.sum_exec_runtime - p->slice_runtime;
+  p->min += min;
+  p->maj += maj;
+  p->cpu += cpu;
+
+  if(!_sample_wanted(p, min, maj, cpu, rec.time - p->slice_start)){
+    p->suppressed++;
+    return;
+  }
+  rec.type = MP3_RECORD_SLICE;
+  rec.pid = current->tgid;
+  rec.tid = current->pid;
+  rec.u.sample.min_flt = min;
+  rec.u.sample.maj_flt = maj;
+  rec.u.sample.cpu_time = cpu;
+  rec.u.sample.interval = rec.time - p->slice_start;
+  _stage_record(&rec);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  exact_task
+//
+// PROCESSING:
+//
+//    This function turns exact accounting of a task on or off. In exact 
+//    mode the task is accounted at every context switch instead of being
+//    sampled. 
+//
+// INPUTS:
+//
+//    p  - the task
+//    on - (1) to account the task at its context switches, (0) to sample it
+//
+// RETURN:
+//
+//   int - (0) on success, (-1) if the kernel has no preempt notifiers or 
+//         the caller is not the task
+//
+// IMPLEMENTATION NOTES
+//
+//   A preempt notifier can only be attached to or detached from the 
+//   running task, so a task turns exact mode on and off itself; it is 
+//   turned off when the task unregisters itself or exits. The module is 
+//   held while a notifier is attached. The sampling timer of the CPU only
+//   runs while it has tasks that are sampled, so a CPU with only exact 
+//   tasks is never woken up for tasks that do not run. Called with 
+//   mp3_mutex held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int exact_task(struct mp3_task_struct *p, int on)
+{
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+  struct mp3_cpu_sampler *s = &per_cpu(mp3_samplers, p->cpu_id);
+
+  if(p->linux_task != current)
+    return -1;
+  if(on == p->exact)
+    return 0;
+  if(on && !try_module_get(THIS_MODULE))
+    return -1;
+
+  mutex_lock(&s->lock);
+  preempt_disable();
+  if(on){
+    p->slice_min = current->min_flt;
+    p->slice_maj = current->maj_flt;
+    p->slice_runtime = current->se.sum_exec_runtime;
+    p->slice_start = ktime_to_ns(ktime_get());
+    preempt_notifier_init(&p->notifier, &exact_ops);
+    preempt_notifier_register(&p->notifier);
+  }else{
+    preempt_notifier_unregister(&p->notifier);
+    // sampling goes on from the current counters
+    p->last_min = current->min_flt;
+    p->last_maj = current->maj_flt;
+    p->last_runtime = current->se.sum_exec_runtime;
+    p->last_time = ktime_to_ns(ktime_get());
+  }
+  p->exact = on;
+  preempt_enable();
+
+  if(on){
+    if(++s->nr_exact == s->nr_tasks)
+      hrtimer_cancel(&s->timer);
+  }else{
+    if(s->nr_exact-- == s->nr_tasks)
+      smp_call_function_single(s->cpu, _start_timer, s, 1);
+  }
+  mutex_unlock(&s->lock);
+
+  if(!on)
+    module_put(THIS_MODULE);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  fault_entry
+//
+// PROCESSING:
+//
+//    This function is called when handle_mm_fault is entered. It decides 
+//    whether the fault is traced and remembers where and when it started. 
+//
+// INPUTS:
+//
+//    ri   - the instance of the return probe
+//    regs - the registers at the entry of handle_mm_fault
+//
+// RETURN:
+//
+//   int - (0) to trace the fault, (1) to skip the return handler
+//
+// IMPLEMENTATION NOTES
+//
+//   Only faults of registered tasks with tracing on are traced, 1 in 
+//   trace_every of them; every fault of a task with a heatmap is followed.
+//   The vma and the faulting address are the second and third arguments of 
+//   handle_mm_fault, read with MP3_FAULT_VMA and MP3_FAULT_ADDRESS (rsi and
+//   rdx, only x86_64 is supported); the ip is the user ip saved on the 
+//   kernel stack of the task. Faults of a task can be taken on several CPUs
+//   at once, so the count is atomic. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int fault_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+  struct mp3_fault_data *d = (struct mp3_fault_data *) ri->data;
+  struct mp3_task_struct *p;
+  unsigned long every;
+  int heat = 0;
+
+  d->trace = 0;
+  rcu_read_lock();
+  p = _lookup_task_rcu(current->pid);
+  if(p != NULL){
+    every = ACCESS_ONCE(p->trace_every);
+    if(every && ((atomic_long_inc_return(&p->trace_count) - 1) % every) == 0)
+      d->trace = 1;
+    heat = (p->heat != NULL);
+  }
+  rcu_read_unlock();
+  if(!d->trace && !heat)
+    return 1;
+
+  d->vma = MP3_FAULT_VMA(regs);
+  d->address = MP3_FAULT_ADDRESS(regs);
+  d->ip = instruction_pointer(task_pt_regs(current));
+  d->start = ktime_to_ns(ktime_get());
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  fault_return
+//
+// PROCESSING:
+//
+//    This function is called when a traced handle_mm_fault returns. It 
+//    stages a fault record on the current CPU. 
+//
+// INPUTS:
+//
+//    ri   - the instance of the return probe
+//    regs - the registers at the return of handle_mm_fault
+//
+// RETURN:
+//
+//   int - 0
+//
+// IMPLEMENTATION NOTES
+//
+//   The probe handler cannot take the sampler lock, so the record goes to 
+//   the stage of the CPU and the sampling thread moves it to the ring. A 
+//   full stage drops the record. The fault is also counted in the heatmap
+//   of the task, if it has one. A fault that returns VM_FAULT_RETRY has 
+//   already dropped mmap_sem, so its vma may be gone, and it is taken 
+//   again; it is neither counted nor recorded, the retry is. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int fault_return(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+  struct mp3_fault_data *d = (struct mp3_fault_data *) ri->data;
+  unsigned long ret = regs_return_value(regs);
+  struct mp3_task_struct *p;
+  struct mp3_record rec;
+
+  if(ret & VM_FAULT_RETRY)
+    return 0;
+  if(!(ret & VM_FAULT_ERROR)){
+    rcu_read_lock();
+    p = _lookup_task_rcu(current->pid);
+    if(p != NULL && p->heat != NULL)
+      _heat_add(p->heat, d->vma, d->address, ret & VM_FAULT_MAJOR);
+    rcu_read_unlock();
+  }
+
+  if(!d->trace)
+    return 0;
+  rec.type = MP3_RECORD_FAULT;
+  rec.pid = current->tgid;
+  rec.tid = current->pid;
+  rec.time = ktime_to_ns(ktime_get());
+  rec.u.fault.address = d->address;
+  rec.u.fault.ip = d->ip;
+  rec.u.fault.latency = rec.time - d->start;
+  rec.u.fault.flags = 0;
+  if(ret & VM_FAULT_MAJOR)
+    rec.u.fault.flags |= MP3_FAULT_MAJOR;
+  if(ret & VM_FAULT_ERROR)
+    rec.u.fault.flags |= MP3_FAULT_ERROR;
+  _stage_record(&rec);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _probe_get
+//
+// PROCESSING:
+//
+//    This function registers the fault probe for its first user. 
+//
+// INPUTS:
+//
+//    None.
+//
+// RETURN:
+//
+//   int - (0) on success, (-1) if the probe cannot be registered
+//
+// IMPLEMENTATION NOTES
+//
+//   The return probe on handle_mm_fault is only registered while at least
+//   one task is traced or has a heatmap, so the fault path of the system 
+//   is untouched otherwise. Without MP3_FAULT_PROBE the arguments of the 
+//   probed function are unknown and the probe is refused. Called with 
+//   mp3_mutex held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int _probe_get(void)
+{
+  int ret;
+
+#ifndef MP3_FAULT_PROBE
+  printk(KERN_INFO "Fault tracing is only supported on x86_64\n");
+  return -1;
+#endif
+  if(nr_probed == 0){
+    // the probe may have been registered before
+    fault_probe.kp.addr = NULL;
+    fault_probe.kp.flags = 0;
+    ret = register_kretprobe(&fault_probe);
+    if(ret < 0){
+      printk(KERN_INFO "Unable to probe handle_mm_fault (error %d)\n", ret);
+      return -1;
+    }
+  }
+  nr_probed++;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _probe_put
+//
+// PROCESSING:
+//
+//    This function unregisters the fault probe when its last user is gone.
+//
+// INPUTS:
+//
+//    None.
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   unregister_kretprobe waits for the running handlers. Called with 
+//   mp3_mutex held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _probe_put(void)
+{
+  if(--nr_probed == 0)
+    unregister_kretprobe(&fault_probe);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _heat_add
+//
+// PROCESSING:
+//
+//    This function counts one fault in the heatmap of a task. 
+//
+// INPUTS:
+//
+//    h       - the heatmap
+//    vma     - the VMA of the fault
+//    address - the faulting address
+//    major   - non zero for a major fault
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   A bucket is an address range of the heatmap granularity within one 
+//   VMA, found by open addressing on the range and the VMA start. The VMA 
+//   is labelled when the bucket is created; the fault path holds mmap_sem,
+//   so the VMA and its file are stable here. Like the trace count, the 
+//   heatmap can be reached from several CPUs at once, so buckets are found,
+//   created and counted under the lock of the heatmap, which the reader of
+//   /proc/mp3/heatmap takes as well. The fault probe runs with preemption
+//   disabled and never in interrupt context. Faults that find no free 
+//   bucket are counted as overflow. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _heat_add(struct mp3_heatmap *h, struct vm_area_struct *vma, unsigned long address, int major)
+{
+  unsigned long start = address & ~((1UL << h->shift) - 1);
+  struct mp3_heat_bucket *b;
+  struct mm_struct *mm = vma->vm_mm;
+  unsigned int i, n;
+
+  spin_lock(&h->lock);
+  i = hash_long(start ^ vma->vm_start, ilog2(MP3_HEAT_BUCKETS));
+  for(n = 0; n < MP3_HEAT_BUCKETS; n++, i = (i + 1) % MP3_HEAT_BUCKETS){
+    b = &h->buckets[i];
+    if(b->used && b->start == start && b->vm_start == vma->vm_start)
+      break;
+    if(!b->used){
+      b->start = start;
+      b->vm_start = vma->vm_start;
+      b->vm_end = vma->vm_end;
+      b->name[0] = 0;
+      if(vma->vm_file){
+        b->kind = MP3_VMA_FILE;
+        strlcpy(b->name, vma->vm_file->f_path.dentry->d_name.name, MP3_HEAT_NAME);
+      }else if(vma->vm_start <= mm->brk && vma->vm_end >= mm->start_brk)
+        b->kind = MP3_VMA_HEAP;
+      else if(vma->vm_start <= mm->start_stack && vma->vm_end >= mm->start_stack)
+        b->kind = MP3_VMA_STACK;
+      else
+        b->kind = MP3_VMA_ANON;
+      b->used = 1;
+      break;
+    }
+  }
+  if(n == MP3_HEAT_BUCKETS)
+    h->overflow++;
+  else if(major)
+    b->major++;
+  else
+    b->minor++;
+  spin_unlock(&h->lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  heat_task
+//
+// PROCESSING:
+//
+//    This function turns the fault heatmap of a registered task on or off.
+//
+// INPUTS:
+//
+//    p  - the registered task
+//    kb - the range granularity in kilobytes, 0 turns the heatmap off
+//
+// RETURN:
+//
+//   int - (0) on success, (-1) if the heatmap cannot be allocated or the 
+//         probe cannot be registered
+//
+// IMPLEMENTATION NOTES
+//
+//   The granularity is rounded down to a power of two of at least a page.
+//   Turning the heatmap on again starts a new one. The fault path reads 
+//   the heatmap under RCU, so an old one is freed after a grace period. 
+//   Called with mp3_mutex held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int heat_task(struct mp3_task_struct *p, unsigned long kb)
+{
+  struct mp3_heatmap *old = p->heat, *h = NULL;
+
+  if(kb){
+    h = vzalloc(sizeof(struct mp3_heatmap));
+    if(h == NULL)
+      return -1;
+    spin_lock_init(&h->lock);
+    h->shift = max_t(unsigned int, ilog2(kb * 1024), PAGE_SHIFT);
+    if(old == NULL && _probe_get()){
+      vfree(h);
+      return -1;
+    }
+  }else if(old != NULL){
+    _probe_put();
+  }
+  rcu_assign_pointer(p->heat, h);
+  if(old != NULL){
+    synchronize_rcu();
+    vfree(old);
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  trace_task
+//
+// PROCESSING:
+//
+//    This function turns fault tracing of a registered task on or off. 
+//
+// INPUTS:
+//
+//    pid   - the PID of the task
+//    every - trace 1 in every faults of the task, 0 turns tracing off
+//
+// RETURN:
+//
+//   int - (0) on success, (-1) if the task is not registered or the probe
+//         cannot be registered
+//
+// IMPLEMENTATION NOTES
+//
+//   The fault probe is held while the task is traced. Called with 
+//   mp3_mutex held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int trace_task(struct mp3_task_struct *p, unsigned long every)
+{
+  if(every && !p->trace_every){
+    if(_probe_get())
+      return -1;
+  }else if(!every && p->trace_every){
+    _probe_put();
+  }
+  atomic_long_set(&p->trace_count, 0);
+  p->trace_every = every;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _wss_scan_pmd
+//
+// PROCESSING:
+//
+//    This function tests and clears the young bit of the pages mapped by
+//    one page table of a VMA. 
+//
+// INPUTS:
+//
+//    p      - the registered task
+//    vma    - the VMA being scanned
+//    addr   - the first address to scan
+//    end    - the end of the VMA
+//    budget - the page table slots that may still be scanned in this tick
+//
+// RETURN:
+//
+//   unsigned long - the address where the scan stopped
+//
+// IMPLEMENTATION NOTES
+//
+//   The scan stops at the end of the page table, the end of the VMA or when
+//   the budget is used up. Every PTE slot costs one unit of budget, present
+//   or not; missing or huge page tables are skipped and cost one unit. 
+//   ptep_test_and_clear_young clears the bit without a TLB flush, as idle 
+//   page tracking does: a page that stays in the TLB can be missed until 
+//   the next context switch, so the estimate errs low. Reclaim uses the 
+//   same bit to find the pages in use, so a young page is handed to it 
+//   with mark_page_accessed before the bit is lost; without that the scan 
+//   would make busy pages look idle and get them reclaimed. 
+//
+///////////////////////////////////////////////////////////////////////////////
+unsigned long _wss_scan_pmd(struct mp3_task_struct *p, struct vm_area_struct *vma, unsigned long addr, unsigned long end, unsigned long *budget)
+{
+  unsigned long next = pmd_addr_end(addr, end);
+  pgd_t *pgd;
+  pud_t *pud;
+  pmd_t *pmd;
+  pte_t *start_pte, *pte;
+  spinlock_t *ptl;
+  unsigned long pfn;
+
+  (*budget)--;
+  pgd = pgd_offset(vma->vm_mm, addr);
+  if(pgd_none(*pgd) || pgd_bad(*pgd))
+    return next;
+  pud = pud_offset(pgd, addr);
+  if(pud_none(*pud) || pud_bad(*pud))
+    return next;
+  pmd = pmd_offset(pud, addr);
+  if(pmd_none(*pmd) || pmd_trans_huge(*pmd) || pmd_bad(*pmd))
+    return next;
+
+  start_pte = pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
+  for(; addr < next && *budget; addr += PAGE_SIZE, pte++, (*budget)--){
+    if(!pte_present(*pte))
+      continue;
+    p->wss_scanned++;
+    if(ptep_test_and_clear_young(vma, addr, pte)){
+      p->wss_accessed++;
+      pfn = pte_pfn(*pte);
+      if(pfn_valid(pfn))
+        mark_page_accessed(pfn_to_page(pfn));
+    }
+  }
+  pte_unmap_unlock(start_pte, ptl);
+  return addr;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _wss_scan
+//
+// PROCESSING:
+//
+//    This function continues the working set scan of a task and emits a 
+//    working set record when a pass over the address space is complete. 
+//
+// INPUTS:
+//
+//    s - the sampler of the CPU of the task
+//    p - the registered task
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   Each tick scans at most wss_pages_per_tick page table slots from where
+//   the last tick stopped; only the present pages count as scanned. The 
+//   working set is the number of pages found accessed in a pass, i.e. 
+//   touched since the previous pass cleared their bit. The scan only tries
+//   mmap_sem, so it never stalls the sampling; I/O and hugetlb mappings 
+//   are skipped. Called with the sampler lock held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _wss_scan(struct mp3_cpu_sampler *s, struct mp3_task_struct *p)
+{
+  struct mm_struct *mm = p->mm;
+  struct vm_area_struct *vma;
+  unsigned long budget = wss_pages_per_tick;
+  unsigned long addr = p->wss_cursor;
+  struct mp3_record rec;
+  int done = 0;
+
+  if(mm == NULL || budget == 0)
+    return;
+  if(!down_read_trylock(&mm->mmap_sem))
+    return;
+  while(budget){
+    vma = find_vma(mm, addr);
+    if(vma == NULL){
+      done = 1;
+      break;
+    }
+    if(addr < vma->vm_start)
+      addr = vma->vm_start;
+    if(vma->vm_flags & (VM_IO | VM_PFNMAP | VM_HUGETLB)){
+      addr = vma->vm_end;
+      continue;
+    }
+    while(addr < vma->vm_end && budget)
+      addr = _wss_scan_pmd(p, vma, addr, vma->vm_end, &budget);
+  }
+  up_read(&mm->mmap_sem);
+  p->wss_cursor = addr;
+  if(!done)
+    return;
+
+  // the pass is complete
+  rec.type = MP3_RECORD_WSS;
+  rec.pid = p->tgid;
+  rec.tid = p->pid;
+  rec.time = ktime_to_ns(ktime_get());
+  rec.u.wss.pages = p->wss_accessed;
+  rec.u.wss.scanned = p->wss_scanned;
+  rec.u.wss.rss = get_mm_rss(mm);
+  rec.u.wss.duration = rec.time - p->wss_start;
+  _ring_put(s, &rec);
+
+  p->wss_pages = p->wss_accessed;
+  p->wss_accessed = 0;
+  p->wss_scanned = 0;
+  p->wss_cursor = 0;
+  p->wss_start = rec.time;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _sample_wanted
+//
+// PROCESSING:
+//
+//    This function tells whether a sample of a task passes the filter of 
+//    the task. 
+//
+// INPUTS:
+//
+//    p        - the task
+//    min      - the minor faults in the interval
+//    maj      - the major faults in the interval
+//    cpu      - the cpu time used in the interval in ns
+//    interval - the length of the interval in ns
+//
+// RETURN:
+//
+//   int - (1) if the sample is stored, (0) if it is suppressed
+//
+// IMPLEMENTATION NOTES
+//
+//   A task without a filter stores every sample. Otherwise the sample is 
+//   stored when any of the thresholds that are set is reached, so an idle
+//   interval never takes a slot of the ring. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int _sample_wanted(struct mp3_task_struct *p, unsigned long min, unsigned long maj, unsigned long cpu, unsigned long long interval)
+{
+  if(!p->filter_maj && !p->filter_rate && !p->filter_cpu)
+    return 1;
+  if(p->filter_maj && maj >= p->filter_maj)
+    return 1;
+  if(p->filter_cpu && cpu >= p->filter_cpu)
+    return 1;
+  // faults per second, without dividing: (min + maj) / interval >= rate
+  if(p->filter_rate && interval && 
+     (unsigned long long) (min + maj) * NSEC_PER_SEC >= (unsigned long long) p->filter_rate * interval)
+    return 1;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _agg_flush
+//
+// PROCESSING:
+//
+//    This function ends the aggregation window of a task and stores its 
+//    summary on the ring of the CPU. 
+//
+// INPUTS:
+//
+//    s   - the sampler of the CPU, NULL to stage the records
+//    p   - the task
+//    now - the end of the window in ns
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   One MP3_RECORD_AGG record per window, with the sum and the largest 
+//   sample of every counter packed in 32 bit fields; the times are in us.
+//   Called with the sampler lock held, or with s NULL once the task is no 
+//   longer sampled; the record is staged then. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _agg_flush(struct mp3_cpu_sampler *s, struct mp3_task_struct *p, unsigned long long now)
+{
+  struct mp3_record rec;
+
+  if(p->agg_count == 0)
+    return;
+  rec.type = MP3_RECORD_AGG;
+  rec.pid = p->tgid;
+  rec.tid = p->pid;
+  rec.time = now;
+  rec.u.agg.count = p->agg_count;
+  rec.u.agg.window_us = min_t(unsigned long long, div64_u64(p->agg[MP3_AGG_INTERVAL].sum, NSEC_PER_USEC), UINT_MAX);
+  rec.u.agg.min_flt = min_t(unsigned long long, p->agg[MP3_AGG_MIN_FLT].sum, UINT_MAX);
+  rec.u.agg.min_flt_max = min_t(unsigned long long, p->agg[MP3_AGG_MIN_FLT].max, UINT_MAX);
+  rec.u.agg.maj_flt = min_t(unsigned long long, p->agg[MP3_AGG_MAJ_FLT].sum, UINT_MAX);
+  rec.u.agg.maj_flt_max = min_t(unsigned long long, p->agg[MP3_AGG_MAJ_FLT].max, UINT_MAX);
+  rec.u.agg.cpu_us = min_t(unsigned long long, div64_u64(p->agg[MP3_AGG_CPU_TIME].sum, NSEC_PER_USEC), UINT_MAX);
+  rec.u.agg.cpu_us_max = min_t(unsigned long long, div64_u64(p->agg[MP3_AGG_CPU_TIME].max, NSEC_PER_USEC), UINT_MAX);
+  if(s != NULL){
+    _ring_put(s, &rec);
+  }else{
+    get_cpu();
+    _stage_record(&rec);
+    put_cpu();
+  }
+  memset(p->agg, 0, sizeof(p->agg));
+  p->agg_count = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _agg_add
+//
+// PROCESSING:
+//
+//    This function folds one sample of a task into its aggregation window,
+//    and ends the window once it is agg_window long. 
+//
+// INPUTS:
+//
+//    s   - the sampler of the CPU
+//    p   - the task
+//    v   - the sample, one value per MP3_AGG_* counter
+//    now - the time of the sample in ns
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   The window is measured by the sum of the sampling intervals, so it 
+//   ends on the first sample at or past agg_window. With aggregation 
+//   turned off the pending window ends on the next sample. Called with the
+//   sampler lock held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _agg_add(struct mp3_cpu_sampler *s, struct mp3_task_struct *p, unsigned long long *v, unsigned long long now)
+{
+  struct mp3_agg *a;
+  int m;
+
+  for(m = 0; m < MP3_AGG_METRICS; m++){
+    a = &p->agg[m];
+    if(v[m] > a->max)
+      a->max = v[m];
+    a->sum += v[m];
+  }
+  p->agg_count++;
+  s->folded++;
+  if(p->agg[MP3_AGG_INTERVAL].sum >= ACCESS_ONCE(agg_window))
+    _agg_flush(s, p, now);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _sample_cpu
+//
+// PROCESSING:
+//
+//    This function gets the sample information for each task assigned to
+//    a CPU and stores it on the ring of that CPU. 
+//
+// INPUTS:
+//
+//    s - the sampler of the CPU
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   Every CPU has its own thread, task list and ring, so the CPUs sample in
+//   parallel. The task list is walked under RCU, so registration never 
+//   waits for a sampling pass and the other way round; the sampler lock 
+//   only keeps the ring to this thread while it writes. Nothing in the 
+//   walk sleeps (the working set scan only tries the mmap_sem). With an 
+//   aggregation window set, the samples are still taken every period but
+//   only the summary of every window reaches the ring. Otherwise the 
+//   sample of a task is only stored if it passes the filter of the task. 
+//   A task that cannot be read is counted in the failed samples of the CPU
+//   rather than logged, since it fails again at every tick until it is 
+//   unregistered. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _sample_cpu(struct mp3_cpu_sampler *s)
+{
+  unsigned long maj, min, cpu;
+  struct mp3_task_struct *p;
+  struct mp3_record rec;
+  unsigned long long now, v[MP3_AGG_METRICS];
+
+  mutex_lock(&s->lock);
+  // the faults traced since the last tick come first
+  _drain_faults(s);
+  // for every task of this CPU, get the stats
+  rcu_read_lock();
+  list_for_each_entry_rcu(p, &s->tasks, cpu_node)
+  {
+    // a task in exact mode accounts itself
+    if(p->exact){
+      _wss_scan(s, p);
+      continue;
+    }
+    // read the stats and store them on the buffer
+    if(_sample_task(p, &min, &maj, &cpu)){
+      // an error occur, the task may have exited past the exit notifier
+      schedule_work(&reap_work);
+      s->failed++;
+      continue;
+    }
+    // store the sum of information for each PID
+    p->min += min;
+    p->maj += maj;
+    p->cpu += cpu;
+
+    now = ktime_to_ns(ktime_get());
+    if(ACCESS_ONCE(agg_window) || p->agg_count){
+      // fold the interval into the window of the task
+      v[MP3_AGG_MIN_FLT] = min;
+      v[MP3_AGG_MAJ_FLT] = maj;
+      v[MP3_AGG_CPU_TIME] = cpu;
+      v[MP3_AGG_INTERVAL] = now - p->last_time;
+      p->last_time = now;
+      _agg_add(s, p, v, now);
+      _wss_scan(s, p);
+      continue;
+    }
+
+    // store the interval on the ring buffer of this CPU, if it is of interest
+    if(!_sample_wanted(p, min, maj, cpu, now - p->last_time)){
+      p->last_time = now;
+      p->suppressed++;
+      s->suppressed++;
+      _wss_scan(s, p);
+      continue;
+    }
+    rec.type = MP3_RECORD_SAMPLE;
+    rec.pid = p->tgid;
+    rec.tid = p->pid;
+    rec.time = now;
+    rec.u.sample.min_flt = min;
+    rec.u.sample.maj_flt = maj;
+    rec.u.sample.cpu_time = cpu;
+    rec.u.sample.interval = now - p->last_time;
+    p->last_time = now;
+    _ring_put(s, &rec);
+
+    // go on with the working set scan of the task
+    _wss_scan(s, p);
+  }
+  rcu_read_unlock();
+  mutex_unlock(&s->lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _records_ready
+//
+// PROCESSING:
+//
+//    This function tells whether the records a consumer did not read yet 
+//    reached the watermark.
+//
+// INPUTS:
+//
+//    slot - the consumer slot
+//
+// RETURN:
+//
+//   int - (1) if there are at least wake_records unread records, or if the
+//         oldest unread record is at least wake_ms old; (0) otherwise
+//
+// IMPLEMENTATION NOTES
+//
+//   The tails are written by the consumers, so the counts are a snapshot; 
+//   records that were already overwritten are not counted. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int _records_ready(int slot)
+{
+  struct mp3_cpu_sampler *s;
+  unsigned long head, tail, unread = 0;
+  unsigned long long oldest = 0, now = ktime_to_ns(ktime_get());
+  int cpu;
+
+  for_each_online_cpu(cpu){
+    s = &per_cpu(mp3_samplers, cpu);
+    if(s->thread == NULL)
+      continue;
+    head = ACCESS_ONCE(s->head);
+    tail = ACCESS_ONCE(s->header->tail[slot]);
+    if(head == tail)
+      continue;
+    if(head - tail > s->capacity)
+      tail = head - s->capacity;
+    smp_rmb();
+    unread += head - tail;
+    if(oldest == 0 || s->records[tail % s->capacity].time < oldest)
+      oldest = s->records[tail % s->capacity].time;
+  }
+  if(unread == 0)
+    return 0;
+  return unread >= wake_records || now - oldest >= (unsigned long long) wake_ms * NSEC_PER_MSEC;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _wake_consumers
+//
+// PROCESSING:
+//
+//    This function wakes up the consumers waiting in poll once one of them
+//    reached the watermark. 
+//
+// INPUTS:
+//
+//    None.
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   All the consumers share one wait queue, so a single wake up is enough.
+//
+///////////////////////////////////////////////////////////////////////////////
+void _wake_consumers(void)
+{
+  int c;
+
+  if(!waitqueue_active(&mp3_waitq))
+    return;
+  for(c = 0; c < MP3_MAX_CONSUMERS; c++){
+    if((ACCESS_ONCE(mp3_consumers) & (1UL << c)) && _records_ready(c)){
+      wake_up_interruptible(&mp3_waitq);
+      break;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  wake_handler
+//
+// PROCESSING:
+//
+//    This function is the age check of the watermark, run every 
+//    WAKE_INTERVAL while a consumer is open. 
+//
+// INPUTS:
+//
+//    work - the wake work
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   The sampling threads only check the watermark when they run, and the 
+//   sampling timer of a CPU is stopped once it has no task left to sample,
+//   so without this check the last records could stay unread forever. The
+//   work stops when the last consumer is closed and is started again by 
+//   open_dev. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void wake_handler(struct work_struct *work)
+{
+  _wake_consumers();
+  if(ACCESS_ONCE(mp3_consumers))
+    schedule_delayed_work(&wake_work, WAKE_INTERVAL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  sample_timer_handler
+//
+// PROCESSING:
+//
+//    This function is called when the sampling timer of a CPU expires. It 
+//    wakes up the sampling thread of the CPU and re-arms the timer. 
+//
+// INPUTS:
+//
+//    timer - the timer embedded in the sampler of the CPU
+//
+// RETURN:
+//
+//   enum hrtimer_restart - HRTIMER_RESTART, the timer is periodic
+//
+// IMPLEMENTATION NOTES
+//
+//   The timer runs in interrupt context, so the sampling itself is done by 
+//   the thread. hrtimer_forward moves the expiry by whole periods from the
+//   previous expiry, so the interval does not drift with the time the 
+//   handler or the thread take. Periods the timer skipped, and ticks that
+//   find the previous one still pending because the thread was busy, are 
+//   both counted as missed. 
+//
+///////////////////////////////////////////////////////////////////////////////
+enum hrtimer_restart sample_timer_handler(struct hrtimer *timer)
+{
+  struct mp3_cpu_sampler *s = container_of(timer, struct mp3_cpu_sampler, timer);
+  unsigned long overruns;
+
+  s->expected = ktime_to_ns(hrtimer_get_expires(timer));
+  // the thread has not sampled the previous tick yet, this one is folded into it
+  if(s->pending)
+    s->missed++;
+  s->pending = 1;
+  wake_up_process(s->thread);
+
+  overruns = hrtimer_forward(timer, hrtimer_cb_get_time(timer), ns_to_ktime(sample_period));
+  if(overruns > 1)
+    s->missed += overruns - 1;
+  return HRTIMER_RESTART;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  sample_thread
+//
+// PROCESSING:
+//
+//    This function is the sampling thread of a CPU. It samples the tasks of
+//    the CPU every time the sampling timer wakes it up. 
+//
+// INPUTS:
+//
+//    data - the sampler of the CPU
+//
+// RETURN:
+//
+//   int - 0 when the thread is stopped
+//
+// IMPLEMENTATION NOTES
+//
+//   The thread is bound to its CPU and runs as SCHED_FIFO, so it runs right
+//   after the timer. The delay from the timer expiry to the start of the 
+//   sampling is the jitter, which is kept for /proc/mp3/stats. The fault
+//   path also wakes the thread up to move staged fault records. After each
+//   pass the thread wakes up the consumers waiting in poll if the 
+//   watermark is reached. The age of the records is also checked by 
+//   wake_handler, which keeps running when no timer is. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int sample_thread(void *data)
+{
+  struct mp3_cpu_sampler *s = (struct mp3_cpu_sampler *) data;
+  unsigned long long jitter;
+
+  while(1){
+    set_current_state(TASK_INTERRUPTIBLE);
+    if(!s->pending && !s->drain && !kthread_should_stop())
+      schedule();
+    __set_current_state(TASK_RUNNING);
+    if(kthread_should_stop())
+      break;
+    s->drain = 0;
+
+    if(s->pending){
+      s->pending = 0;
+      jitter = ktime_to_ns(ktime_get()) - s->expected;
+      s->ticks++;
+      s->jitter_total += jitter;
+      if(jitter > s->jitter_max)
+        s->jitter_max = jitter;
+
+      _sample_cpu(s);
+    }else{
+      // woken up to move the staged records
+      mutex_lock(&s->lock);
+      _drain_faults(s);
+      mutex_unlock(&s->lock);
+    }
+
+    _wake_consumers();
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _start_timer
+//
+// PROCESSING:
+//
+//    This function starts the sampling timer of the CPU it runs on. 
+//
+// INPUTS:
+//
+//    data - the sampler of the CPU
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   A pinned timer expires on the CPU that started it, so this function is
+//   called on the CPU of the sampler through smp_call_function_single. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _start_timer(void *data)
+{
+  struct mp3_cpu_sampler *s = (struct mp3_cpu_sampler *) data;
+
+  hrtimer_start(&s->timer, ktime_add_ns(ktime_get(), sample_period), HRTIMER_MODE_ABS_PINNED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _pick_cpu
+//
+// PROCESSING:
+//
+//    This function chooses the CPU that samples a new task. 
+//
+// INPUTS:
+//
+//    None.
+//
+// RETURN:
+//
+//   int - the online CPU with the fewest tasks, (-1) if there is none
+//
+// IMPLEMENTATION NOTES
+//
+//   Called with mp3_mutex held, so concurrent registrations do not pick 
+//   the same CPU from the same counts. Only CPUs that have a sampling 
+//   thread are considered. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int _pick_cpu(void)
+{
+  int cpu, best = -1;
+
+  for_each_online_cpu(cpu){
+    if(per_cpu(mp3_samplers, cpu).thread == NULL)
+      continue;
+    if(best < 0 || per_cpu(mp3_samplers, cpu).nr_tasks < per_cpu(mp3_samplers, best).nr_tasks)
+      best = cpu;
+  }
+  return best;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _sampler_add
+//
+// PROCESSING:
+//
+//    This function assigns a task to the sampler of a CPU and starts the 
+//    sampling timer of that CPU if it was idle. 
+//
+// INPUTS:
+//
+//    s - the sampler of the CPU
+//    p - the task to be sampled
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   The timer samples every sample_period nanoseconds (50 milliseconds 
+//   unless changed with the "P" command). Called with mp3_mutex held, which
+//   serializes the changes of the task lists; the sampling thread walks 
+//   them under RCU. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _sampler_add(struct mp3_cpu_sampler *s, struct mp3_task_struct *p)
+{
+  p->cpu_id = s->cpu;
+  list_add_tail_rcu(&p->cpu_node, &s->tasks);
+  // the timer runs while the CPU has tasks to sample
+  if(s->nr_tasks++ == s->nr_exact){
+    printk("Starting the sampling timer on CPU %d\n", s->cpu);
+    smp_call_function_single(s->cpu, _start_timer, s, 1);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _sampler_remove
+//
+// PROCESSING:
+//
+//    This function removes a task from the sampler of its CPU and stops the
+//    sampling timer of that CPU when it was the last task. 
+//
+// INPUTS:
+//
+//    p - the task that is no longer sampled
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   Called with mp3_mutex held. The sampling thread may still be looking 
+//   at the task, so it can only be freed after a grace period. The timer 
+//   handler does not look at the tasks, so it is cancelled synchronously 
+//   here. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _sampler_remove(struct mp3_task_struct *p)
+{
+  struct mp3_cpu_sampler *s = &per_cpu(mp3_samplers, p->cpu_id);
+
+  list_del_rcu(&p->cpu_node);
+  if(p->exact)
+    s->nr_exact--;
+  if(--s->nr_tasks == s->nr_exact)
+    hrtimer_cancel(&s->timer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _task_free
+//
+// PROCESSING:
+//
+//    This function frees an unregistered task once nobody looks at it 
+//    anymore. 
+//
+// INPUTS:
+//
+//    work - the free work of the task
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   Runs from a work queue, since mmput may sleep. The samples of the 
+//   window the task was aggregating are staged first, so they are not 
+//   lost. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _task_free(struct work_struct *work)
+{
+  struct mp3_task_struct *p = container_of(work, struct mp3_task_struct, free_work);
+
+  _agg_flush(NULL, p, ktime_to_ns(ktime_get()));
+  if(p->heat)
+    vfree(p->heat);
+  if(p->mm)
+    mmput(p->mm);
+  put_task_struct(p->linux_task);
+  kfree(p);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _task_free_rcu
+//
+// PROCESSING:
+//
+//    This function is called after the grace period that follows the 
+//    unregistration of a task; it hands the task to _task_free. 
+//
+// INPUTS:
+//
+//    head - the RCU head of the task
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   RCU callbacks cannot sleep, so the task is freed from a work, on the
+//   queue of the module so that the exit can flush exactly these works. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _task_free_rcu(struct rcu_head *head)
+{
+  struct mp3_task_struct *p = container_of(head, struct mp3_task_struct, rcu);
+
+  INIT_WORK(&p->free_work, _task_free);
+  queue_work(mp3_free_wq, &p->free_work);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  register_task
+//
+// PROCESSING:
+//
+//    This funtion implements the task registration
+//
+// INPUTS:
+//
+//    pid - 		the process ID of the calling task
+//    period -		the time from when a job of the calling task begins 
+//			executing until the time the next job of the calling task
+//			starts running 
+//    processing time - the total time it takes for a single job to run of the 
+//			calling task to run
+//
+// RETURN:
+//
+//   int - (-1) if there is no task associated with the given PID
+//	    (0) if the task is registered successfully. 
+//
+// IMPLEMENTATION NOTES
+//
+//   The task is inserted into the task list and handed to the sampler of 
+//   the online CPU with the fewest tasks, which samples it into its own 
+//   ring from then on. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int register_task(long pid, long period, long processingTime)
+{
+  struct mp3_task_struct *p, *q;
+  int cpu;
+  
+  p = kmalloc(sizeof(struct mp3_task_struct), GFP_KERNEL);
+  if(p == NULL)
+    return -1;
+
+  // get the task by given global PID and keep it until the task is freed
+  rcu_read_lock();
+  p->linux_task = find_task_by_global_pid(pid);
+  if(p->linux_task)
+    get_task_struct(p->linux_task);
+  rcu_read_unlock();
+  if(p->linux_task == NULL){
+    // no task was found associated with given PID
+    printk(KERN_INFO "No task associated with PID %ld\n", pid);
+    // free the memory
+    kfree(p);
+    // return error
+    return -1;
+  }
+
+  // Update the task structure
+  p->pid = pid;
+  p->tgid = p->linux_task->tgid;
+  p->min = 0;
+  p->maj = 0;
+  p->cpu = 0;
+  p->last_time = ktime_to_ns(ktime_get());
+  // start counting from the current values of the task
+  p->last_min = p->linux_task->min_flt;
+  p->last_maj = p->linux_task->maj_flt;
+  p->last_runtime = p->linux_task->se.sum_exec_runtime;
+  p->trace_every = 0;
+  atomic_long_set(&p->trace_count, 0);
+  p->heat = NULL;
+  p->wss_cursor = 0;
+  p->wss_accessed = 0;
+  p->wss_scanned = 0;
+  p->wss_start = p->last_time;
+  p->wss_pages = 0;
+  p->lc_maj = 0;
+  p->lc_cpu = 0;
+  p->suspended = 0;
+  p->pff_flt = 0;
+  p->pff_rate = 0;
+  p->pff_allowance = 0;
+  p->pff_lent = 0;
+  memset(p->agg, 0, sizeof(p->agg));
+  p->agg_count = 0;
+  p->filter_maj = 0;
+  p->filter_rate = 0;
+  p->filter_cpu = 0;
+  p->suppressed = 0;
+  p->exact = 0;
+  p->target = NULL;
+
+  mutex_lock(&mp3_mutex);
+  //only add if PID doesn't already exist, and give it to a CPU
+  cpu = _pick_cpu();
+  if(_lookup_task(pid) != NULL || cpu < 0){
+    mutex_unlock(&mp3_mutex);
+    put_task_struct(p->linux_task);
+    kfree(p);
+    return -1;
+  }
+  // an exiting task would never be unregistered by the exit notifier
+  if(p->linux_task->flags & PF_EXITING){
+    mutex_unlock(&mp3_mutex);
+    printk(KERN_INFO "PID %ld is exiting\n", pid);
+    put_task_struct(p->linux_task);
+    kfree(p);
+    return -1;
+  }
+  // a thread of a process stopped by the load control is stopped as well
+  list_for_each_entry(q, &mp3_task_list, task_node)
+  {
+    if(q->suspended && q->tgid == p->tgid){
+      p->suspended = 1;
+      p->suspend_order = q->suspend_order;
+      break;
+    }
+  }
+  // keep the address space for the working set scan
+  p->mm = get_task_mm(p->linux_task);
+  // Insert the task into the task list and give it to a CPU
+  _insert_task(p);
+  hlist_add_head_rcu(&p->hash_node, &mp3_task_hash[hash_long(pid, MP3_HASH_BITS)]);
+  list_count++;
+  _sampler_add(&per_cpu(mp3_samplers, cpu), p);
+  mutex_unlock(&mp3_mutex);
+
+  printk(KERN_INFO "Task added to list (CPU %d)\n", p->cpu_id);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  unregister_task
+//
+// PROCESSING:
+//
+//    This funtion implements the task de-registration
+//
+// INPUTS:
+//
+//    pid - the process ID of the calling task
+//
+// RETURN:
+//
+//   int - (-1) if there is no task associated with the given PID, or if 
+//	   it is in exact mode and the caller is not the task
+//	   (0) if the task is unregistered successfully. 
+//
+// IMPLEMENTATION NOTES
+//
+//   The task is removed from the task list, the task hash and the sampler 
+//   of its CPU, and its fault tracing is turned off. The fault path and 
+//   the sampling thread may still look at it, so its memory is freed after
+//   a grace period, without waiting for it here. Memory lent to it by the 
+//   fault frequency controller goes back to the pool. A task in exact mode
+//   can only be unregistered by itself (or when it exits). 
+//
+///////////////////////////////////////////////////////////////////////////////
+int unregister_task(long pid)
+{
+  struct mp3_task_struct *p;
+
+  mutex_lock(&mp3_mutex);
+  p = _lookup_task(pid);
+  if(p == NULL){
+    mutex_unlock(&mp3_mutex);
+    return -1;
+  }
+  // the notifier of a task in exact mode can only be detached by the task
+  if(p->exact && exact_task(p, 0)){
+    mutex_unlock(&mp3_mutex);
+    printk(KERN_INFO "PID %ld is in exact mode and must unregister itself\n", pid);
+    return -1;
+  }
+  printk(KERN_INFO "Found node with PID %ld\n", p->pid);
+  list_del(&p->task_node);
+  hlist_del_rcu(&p->hash_node);
+  trace_task(p, 0);
+  // the heatmap goes with the task
+  if(p->heat)
+    _probe_put();
+  _lc_resume(p);
+  _pff_release(p);
+  if(p->target){
+    // the rollup of the target still counts the task
+    _target_leave(p);
+    p->target->nr_tasks--;
+  }
+  list_count--;
+  _sampler_remove(p);
+  mutex_unlock(&mp3_mutex);
+
+  call_rcu(&p->rcu, _task_free_rcu);
+  printk(KERN_INFO "Removing PID %ld\n", pid);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  task_exit_notify
+//
+// PROCESSING:
+//
+//    This function is called by the kernel whenever a task exits; it 
+//    unregisters the exiting task if it never unregistered itself. 
+//
+// INPUTS:
+//
+//    self - the notifier block
+//    val  - the profiling event (PROFILE_TASK_EXIT)
+//    data - the task_struct of the exiting task
+//
+// RETURN:
+//
+//   int - NOTIFY_OK
+//
+// IMPLEMENTATION NOTES
+//
+//   The sampler stops sampling the task right away, and the sampling timer
+//   of its CPU is stopped when it was the last task of that CPU. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int task_exit_notify(struct notifier_block *self, unsigned long val, void *data)
+{
+  struct task_struct *task = (struct task_struct *) data;
+  struct mp3_task_struct *p;
+  int registered = 0;
+
+  mutex_lock(&mp3_mutex);
+  if(list_count){
+    p = _lookup_task(task->pid);
+    registered = (p != NULL && p->linux_task == task);
+  }
+  mutex_unlock(&mp3_mutex);
+
+  if(registered){
+    printk(KERN_INFO "PID %d exited without unregistering\n", task->pid);
+    unregister_task(task->pid);
+    mutex_lock(&mp3_mutex);
+    reaped_count++;
+    mutex_unlock(&mp3_mutex);
+  }
+  return NOTIFY_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  reap_handler
+//
+// PROCESSING:
+//
+//   Unregisters the tasks that are dead but still registered. 
+//
+// INPUTS:
+//
+//    work - the reap work
+//
+// RETURN:
+//
+//   None
+//
+// IMPLEMENTATION NOTES
+//
+//   A task registered between its exit notification and the moment it is
+//   flagged PF_EXITING is missed by the notifier. The sampler queues this
+//   work when it fails to read a task, and the pinned task_struct tells 
+//   whether the task is dead. The scan stops when a batch makes no progress
+//   so a task in exact mode that cannot be unregistered is not retried. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void reap_handler(struct work_struct *work)
+{
+  struct mp3_task_struct *p;
+  long dead[MP3_TARGET_BATCH];
+  int n, i, reaped;
+
+  do{
+    n = 0;
+    mutex_lock(&mp3_mutex);
+    list_for_each_entry(p, &mp3_task_list, task_node)
+    {
+      if(p->linux_task->exit_state == 0)
+        continue;
+      dead[n++] = p->pid;
+      if(n == MP3_TARGET_BATCH)
+        break;
+    }
+    mutex_unlock(&mp3_mutex);
+
+    reaped = 0;
+    for(i = 0; i < n; i++)
+      if(unregister_task(dead[i]) == 0)
+        reaped++;
+    mutex_lock(&mp3_mutex);
+    reaped_count += reaped;
+    mutex_unlock(&mp3_mutex);
+  }while(n == MP3_TARGET_BATCH && reaped);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _target_match
+//
+// PROCESSING:
+//
+//    This function tells whether a task belongs to a profiling target. 
+//
+// INPUTS:
+//
+//    t    - the target
+//    task - the task
+//
+// RETURN:
+//
+//   int - (1) if the task belongs to the target, (0) otherwise
+//
+// IMPLEMENTATION NOTES
+//
+//   A task belongs to a tree target when the root process is the task's 
+//   process or one of its ancestors, init included, and to a cgroup target
+//   when it is in the memory cgroup of the target. Called under 
+//   rcu_read_lock. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int _target_match(struct mp3_target *t, struct task_struct *task)
+{
+  struct task_struct *a;
+
+  if(t->kind == MP3_TARGET_CGROUP){
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+    return task_subsys_state(task, mem_cgroup_subsys_id) == t->css;
+#else
+    return 0;
+#endif
+  }
+  for(a = task; ; a = rcu_dereference(a->real_parent)){
+    if(a->tgid == t->root)
+      return 1;
+    // init and the idle task are their own top
+    if(a->pid <= 1)
+      return 0;
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _target_scan
+//
+// PROCESSING:
+//
+//    This function registers the tasks of a target that are not registered
+//    yet. 
+//
+// INPUTS:
+//
+//    t - the target
+//
+// RETURN:
+//
+//   int - the number of tasks registered; 0 means a further pass would 
+//         not make progress
+//
+// IMPLEMENTATION NOTES
+//
+//   The task list is walked under RCU and the tasks found are registered 
+//   afterwards, at most MP3_TARGET_BATCH per pass. Every thread is 
+//   registered on its own, so the per-thread series are kept. A task that 
+//   cannot be registered is remembered in the target and skipped by the 
+//   following passes, so it does not hide the tasks behind it; the 
+//   periodic rescan forgets them and tries again. Called with target_mutex
+//   held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int _target_scan(struct mp3_target *t)
+{
+  struct task_struct *g, *task;
+  struct mp3_task_struct *p;
+  pid_t found[MP3_TARGET_BATCH];
+  int n = 0, registered = 0, i;
+
+  rcu_read_lock();
+  do_each_thread(g, task){
+    if(task->mm == NULL || (task->flags & PF_EXITING) || !_target_match(t, task))
+      continue;
+    if(_lookup_task_rcu(task->pid) != NULL)
+      continue;
+    for(i = 0; i < t->nr_failed && t->failed[i] != task->pid; i++)
+      ;
+    if(i < t->nr_failed)
+      continue;
+    found[n++] = task->pid;
+    if(n == MP3_TARGET_BATCH)
+      goto out;
+  }while_each_thread(g, task);
+out:
+  rcu_read_unlock();
+
+  for(i = 0; i < n; i++){
+    if(register_task(found[i], 0, 0)){
+      if(t->nr_failed < MP3_TARGET_BATCH)
+        t->failed[t->nr_failed++] = found[i];
+      continue;
+    }
+    registered++;
+    mutex_lock(&mp3_mutex);
+    p = _lookup_task(found[i]);
+    if(p != NULL && p->target == NULL){
+      p->target = t;
+      p->roll_min = p->min;
+      p->roll_maj = p->maj;
+      p->roll_cpu = p->cpu;
+      p->roll_gen = 0;
+      t->nr_tasks++;
+    }
+    mutex_unlock(&mp3_mutex);
+  }
+  return registered;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _target_rollup
+//
+// PROCESSING:
+//
+//    This function stores the faults and cpu time of every process of a 
+//    target since the last rollup, one record per process. 
+//
+// INPUTS:
+//
+//    t - the target
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   The threads of a target are registered one by one, so the threads of
+//   each process are summed here: the task list is walked once per process
+//   and every task counted is marked with the pass. Called with 
+//   target_mutex held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _target_rollup(struct mp3_target *t)
+{
+  struct mp3_task_struct *p, *q;
+  struct mp3_record rec;
+
+  rec.time = ktime_to_ns(ktime_get());
+  rec.type = MP3_RECORD_ROLLUP;
+  rec.u.sample.interval = rec.time - t->last_time;
+  mutex_lock(&mp3_mutex);
+  t->roll_gen++;
+  list_for_each_entry(p, &mp3_task_list, task_node)
+  {
+    if(p->target != t || p->roll_gen == t->roll_gen)
+      continue;
+    rec.pid = p->tgid;
+    rec.tid = 0;
+    rec.u.sample.min_flt = 0;
+    rec.u.sample.maj_flt = 0;
+    rec.u.sample.cpu_time = 0;
+    q = p;
+    list_for_each_entry_from(q, &mp3_task_list, task_node)
+    {
+      if(q->target != t || q->tgid != p->tgid)
+        continue;
+      rec.u.sample.min_flt += q->min - q->roll_min;
+      rec.u.sample.maj_flt += q->maj - q->roll_maj;
+      rec.u.sample.cpu_time += q->cpu - q->roll_cpu;
+      q->roll_min = q->min;
+      q->roll_maj = q->maj;
+      q->roll_cpu = q->cpu;
+      q->roll_gen = t->roll_gen;
+      rec.tid++;
+    }
+    get_cpu();
+    _stage_record(&rec);
+    put_cpu();
+  }
+  t->last_time = rec.time;
+  mutex_unlock(&mp3_mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _target_leave
+//
+// PROCESSING:
+//
+//    This function keeps the counters of a task that leaves its target in
+//    the rollup of its process. 
+//
+// INPUTS:
+//
+//    p - the task, already out of the task list
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   The counters since the last rollup are moved to another registered 
+//   thread of the process, by moving back the baseline of that thread. The
+//   last thread of the process stores them right away, in a record with no
+//   thread left. Called with mp3_mutex held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _target_leave(struct mp3_task_struct *p)
+{
+  struct mp3_task_struct *q;
+  struct mp3_record rec;
+
+  list_for_each_entry(q, &mp3_task_list, task_node)
+  {
+    if(q->target == p->target && q->tgid == p->tgid){
+      q->roll_min -= p->min - p->roll_min;
+      q->roll_maj -= p->maj - p->roll_maj;
+      q->roll_cpu -= p->cpu - p->roll_cpu;
+      return;
+    }
+  }
+  rec.time = ktime_to_ns(ktime_get());
+  rec.type = MP3_RECORD_ROLLUP;
+  rec.pid = p->tgid;
+  rec.tid = 0;
+  rec.u.sample.min_flt = p->min - p->roll_min;
+  rec.u.sample.maj_flt = p->maj - p->roll_maj;
+  rec.u.sample.cpu_time = p->cpu - p->roll_cpu;
+  rec.u.sample.interval = rec.time - p->target->last_time;
+  get_cpu();
+  _stage_record(&rec);
+  put_cpu();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  target_handler
+//
+// PROCESSING:
+//
+//    This function runs every second while there are profiling targets; it
+//    registers the tasks that joined a target and stores the rollup of 
+//    every target. 
+//
+// INPUTS:
+//
+//    work - the target work
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   Forks are caught right away by the fork probe; the scan here catches 
+//   the tasks moved into a cgroup. The work stops once the last target is
+//   dropped. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void target_handler(struct work_struct *work)
+{
+  struct mp3_target *t;
+
+  mutex_lock(&target_mutex);
+  list_for_each_entry(t, &mp3_target_list, node)
+  {
+    t->nr_failed = 0;
+    _target_scan(t);
+    _target_rollup(t);
+  }
+  if(!list_empty(&mp3_target_list))
+    schedule_delayed_work(&target_work, TARGET_INTERVAL);
+  mutex_unlock(&target_mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  target_scan_handler
+//
+// PROCESSING:
+//
+//    This function registers the new tasks of every target after a task of
+//    a target forked. 
+//
+// INPUTS:
+//
+//    work - the scan work
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   Forks that come while the work is pending are handled by the same 
+//   scan. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void target_scan_handler(struct work_struct *work)
+{
+  struct mp3_target *t;
+
+  mutex_lock(&target_mutex);
+  list_for_each_entry(t, &mp3_target_list, node)
+  {
+    while(_target_scan(t) > 0)
+      ;
+  }
+  mutex_unlock(&target_mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  fork_entry
+//
+// PROCESSING:
+//
+//    This function is called whenever a new task is about to run for the 
+//    first time; it schedules a target scan if the parent belongs to a 
+//    target. 
+//
+// INPUTS:
+//
+//    kp   - the fork probe
+//    regs - the registers at the entry of wake_up_new_task
+//
+// RETURN:
+//
+//   int - 0
+//
+// IMPLEMENTATION NOTES
+//
+//   Runs in the context of the parent, which cannot sleep here, so the new
+//   task is registered by the scan work. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int fork_entry(struct kprobe *kp, struct pt_regs *regs)
+{
+  struct mp3_task_struct *p;
+
+  rcu_read_lock();
+  p = _lookup_task_rcu(current->pid);
+  if(p != NULL && p->target != NULL)
+    schedule_work(&target_scan_work);
+  rcu_read_unlock();
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  add_target
+//
+// PROCESSING:
+//
+//    This function adds a profiling target and registers its tasks. 
+//
+// INPUTS:
+//
+//    kind - MP3_TARGET_TREE for the process and all its descendants, 
+//           MP3_TARGET_CGROUP for every task in the memory cgroup of the 
+//           process
+//    pid  - the process
+//
+// RETURN:
+//
+//   int - (0) on success, (-1) if the process does not exist, already is 
+//         a target, or its cgroup cannot be a target
+//
+// IMPLEMENTATION NOTES
+//
+//   The fork probe is registered with the first target. A cgroup target is
+//   named by a process in it, not by a cgroup path, since this kernel has
+//   no lookup of a cgroup by path for modules; it is the memory cgroup of 
+//   the process, which the controllers act on. The root cgroup holds every
+//   task of the system and cannot be a target. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int add_target(int kind, pid_t pid)
+{
+  struct mp3_target *t;
+  struct task_struct *task;
+  int ret;
+
+  t = kzalloc(sizeof(struct mp3_target), GFP_KERNEL);
+  if(t == NULL)
+    return -1;
+  t->kind = kind;
+  t->root = pid;
+  t->last_time = ktime_to_ns(ktime_get());
+
+  rcu_read_lock();
+  task = find_task_by_global_pid(pid);
+  if(task == NULL){
+    rcu_read_unlock();
+    kfree(t);
+    return -1;
+  }
+  if(kind == MP3_TARGET_CGROUP){
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+    t->css = task_subsys_state(task, mem_cgroup_subsys_id);
+    if(t->css->cgroup->parent == NULL)
+      t->css = NULL;
+    else
+      css_get(t->css);
+#endif
+    if(t->css == NULL){
+      rcu_read_unlock();
+      kfree(t);
+      return -1;
+    }
+  }
+  rcu_read_unlock();
+
+  mutex_lock(&target_mutex);
+  if(list_empty(&mp3_target_list)){
+    // the probe may have been registered before
+    fork_probe.addr = NULL;
+    fork_probe.flags = 0;
+    ret = register_kprobe(&fork_probe);
+    if(ret < 0)
+      printk(KERN_INFO "Unable to probe wake_up_new_task (error %d), forks are found by the rescan\n", ret);
+    fork_probed = (ret == 0);
+    schedule_delayed_work(&target_work, TARGET_INTERVAL);
+  }
+  mutex_lock(&mp3_mutex);
+  list_add_tail(&t->node, &mp3_target_list);
+  mutex_unlock(&mp3_mutex);
+  while(_target_scan(t) > 0)
+    ;
+  mutex_unlock(&target_mutex);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  drop_target
+//
+// PROCESSING:
+//
+//    This function removes a profiling target and unregisters its tasks. 
+//
+// INPUTS:
+//
+//    pid - the process the target was given by, 0 for every target
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   The tasks are detached from the target first, so a task in exact mode
+//   that cannot be unregistered here stays registered on its own. They are
+//   detached and unregistered MP3_TARGET_BATCH at a time, until none is 
+//   left. The fork probe is unregistered with the last target; the works 
+//   stop by themselves. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void drop_target(pid_t pid)
+{
+  struct mp3_target *t, *tmp;
+  struct mp3_task_struct *p;
+  pid_t members[MP3_TARGET_BATCH];
+  int n, i;
+
+  mutex_lock(&target_mutex);
+  list_for_each_entry_safe(t, tmp, &mp3_target_list, node)
+  {
+    if(pid && t->root != pid)
+      continue;
+    do{
+      n = 0;
+      mutex_lock(&mp3_mutex);
+      list_for_each_entry(p, &mp3_task_list, task_node)
+      {
+        if(p->target != t)
+          continue;
+        p->target = NULL;
+        members[n++] = p->pid;
+        if(n == MP3_TARGET_BATCH)
+          break;
+      }
+      mutex_unlock(&mp3_mutex);
+      for(i = 0; i < n; i++)
+        if(unregister_task(members[i]))
+          printk(KERN_INFO "PID %d stays registered without its target\n", members[i]);
+    }while(n == MP3_TARGET_BATCH);
+
+    printk(KERN_INFO "Dropping the target of PID %d\n", t->root);
+    mutex_lock(&mp3_mutex);
+    list_del(&t->node);
+    mutex_unlock(&mp3_mutex);
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+    if(t->css)
+      css_put(t->css);
+#endif
+    kfree(t);
+  }
+  if(list_empty(&mp3_target_list) && fork_probed){
+    unregister_kprobe(&fork_probe);
+    fork_probed = 0;
+  }
+  mutex_unlock(&target_mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _lc_suspend
+//
+// PROCESSING:
+//
+//    This function stops the registered process with the largest resident
+//    set that is not stopped yet. 
+//
+// INPUTS:
+//
+//    None.
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   The task gets SIGSTOP, which stops its whole thread group, so the load
+//   control works on processes: every registered thread of the process is
+//   marked suspended, lc_nr_suspended counts processes, and a process is 
+//   only stopped while another registered process keeps running. Called 
+//   with mp3_mutex held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _lc_suspend(void)
+{
+  struct mp3_task_struct *p, *victim = NULL;
+  unsigned long rss, max_rss = 0;
+  int others = 0;
+
+  list_for_each_entry(p, &mp3_task_list, task_node)
+  {
+    if(p->suspended || p->mm == NULL)
+      continue;
+    rss = get_mm_rss(p->mm);
+    if(victim == NULL || rss > max_rss){
+      victim = p;
+      max_rss = rss;
+    }
+  }
+  if(victim == NULL)
+    return;
+  // keep at least one process running
+  list_for_each_entry(p, &mp3_task_list, task_node)
+  {
+    if(!p->suspended && p->tgid != victim->tgid){
+      others = 1;
+      break;
+    }
+  }
+  if(!others)
+    return;
+  printk(KERN_INFO "Thrashing: suspending process %d (%lu pages)\n", victim->tgid, max_rss);
+  send_sig(SIGSTOP, victim->linux_task, 1);
+  lc_order++;
+  list_for_each_entry(p, &mp3_task_list, task_node)
+  {
+    if(p->tgid != victim->tgid)
+      continue;
+    p->suspended = 1;
+    p->suspend_order = lc_order;
+  }
+  lc_nr_suspended++;
+  lc_suspends++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _lc_resume
+//
+// PROCESSING:
+//
+//    This function continues a process stopped by the load control. 
+//
+// INPUTS:
+//
+//    p - a task of the process to continue, NULL for the process stopped 
+//        last
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   A task is only passed in when it is unregistered, after it left the 
+//   task list; if its process is stopped, the process stays stopped as 
+//   long as another of its threads is registered, and is continued with 
+//   the last one. Called with mp3_mutex held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _lc_resume(struct mp3_task_struct *p)
+{
+  struct mp3_task_struct *q;
+  int gone = (p != NULL);
+
+  if(p == NULL){
+    list_for_each_entry(q, &mp3_task_list, task_node)
+    {
+      if(q->suspended && (p == NULL || q->suspend_order > p->suspend_order))
+        p = q;
+    }
+  }
+  if(p == NULL || !p->suspended)
+    return;
+  p->suspended = 0;
+  list_for_each_entry(q, &mp3_task_list, task_node)
+  {
+    if(q->tgid != p->tgid || !q->suspended)
+      continue;
+    // the process stays stopped for the threads still registered
+    if(gone)
+      return;
+    q->suspended = 0;
+  }
+  printk(KERN_INFO "Resuming process %d\n", p->tgid);
+  send_sig(SIGCONT, p->linux_task, 1);
+  lc_nr_suspended--;
+  lc_resumes++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  lc_handler
+//
+// PROCESSING:
+//
+//    This function is the load check, run every second while the load 
+//    control is on. It suspends a task when the registered tasks thrash 
+//    and resumes one when the pressure is gone. 
+//
+// INPUTS:
+//
+//    work - the load control work
+//
+// RETURN:
+//
+//    Nothing.
+//
+// IMPLEMENTATION NOTES
+//
+//   The major fault rate and the cpu utilization come from the counters 
+//   the samplers keep for every registered task; the utilization is the 
+//   cpu time of the tasks over the online CPUs. The tasks thrash when the
+//   fault rate is above lc_maj_rate while the utilization is below 
+//   lc_cpu_pct; a stopped task is resumed once the fault rate falls under 
+//   half of lc_maj_rate. Every second is also charged to one of three 
+//   states (thrashing, controlled, normal) with the cpu time used in it,
+//   so the stats show the throughput kept by the control against the 
+//   thrashing baseline. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void lc_handler(struct work_struct *work)
+{
+  struct mp3_task_struct *p;
+  unsigned long maj = 0;
+  unsigned long long cpu = 0, capacity;
+  unsigned long pct;
+
+  mutex_lock(&mp3_mutex);
+  if(!lc_enabled){
+    mutex_unlock(&mp3_mutex);
+    return;
+  }
+  list_for_each_entry(p, &mp3_task_list, task_node)
+  {
+    maj += p->maj - p->lc_maj;
+    cpu += p->cpu - p->lc_cpu;
+    p->lc_maj = p->maj;
+    p->lc_cpu = p->cpu;
+  }
+  capacity = (unsigned long long) num_online_cpus() * NSEC_PER_SEC * LC_INTERVAL / HZ;
+  pct = div64_u64(cpu * 100, capacity);
+
+  if(maj > lc_maj_rate && pct < lc_cpu_pct){
+    lc_thrash_secs++;
+    lc_thrash_cpu += cpu;
+    _lc_suspend();
+  }else if(lc_nr_suspended){
+    lc_control_secs++;
+    lc_control_cpu += cpu;
+    if(maj < lc_maj_rate / 2)
+      _lc_resume(NULL);
+  }else{
+    lc_normal_secs++;
+    lc_normal_cpu += cpu;
+  }
+  schedule_delayed_work(&lc_work, LC_INTERVAL);
+  mutex_unlock(&mp3_mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  load_control
+//
+// PROCESSING:
+//
+//    This function turns the load control on or off. 
+//
+// INPUTS:
+//
+//    maj_rate - the major faults per second of the thrashing threshold, 
+//               0 turns the load control off
+//    cpu_pct  - the cpu utilization of the thrashing threshold
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   Turning it off continues every task it stopped. It must not be called
+//   with mp3_mutex held, since it waits for the load check. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void load_control(unsigned long maj_rate, unsigned long cpu_pct)
+{
+  struct mp3_task_struct *p;
+
+  mutex_lock(&mp3_mutex);
+  if(maj_rate){
+    lc_maj_rate = maj_rate;
+    lc_cpu_pct = cpu_pct;
+    if(!lc_enabled){
+      lc_enabled = 1;
+      list_for_each_entry(p, &mp3_task_list, task_node)
+      {
+        p->lc_maj = p->maj;
+        p->lc_cpu = p->cpu;
+      }
+      schedule_delayed_work(&lc_work, LC_INTERVAL);
+    }
+    mutex_unlock(&mp3_mutex);
+    return;
+  }
+  lc_enabled = 0;
+  while(lc_nr_suspended)
+    _lc_resume(NULL);
+  mutex_unlock(&mp3_mutex);
+  cancel_delayed_work_sync(&lc_work);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _pff_release
+//
+// PROCESSING:
+//
+//    This function gives the pages lent to a task back to the pool. 
+//
+// INPUTS:
+//
+//    p - the task that leaves the controller
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   Called with mp3_mutex held, when the task is unregistered or the 
+//   controller is turned off. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _pff_release(struct mp3_task_struct *p)
+{
+  pff_pool += p->pff_lent;
+  p->pff_lent = 0;
+  p->pff_allowance = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  pff_handler
+//
+// PROCESSING:
+//
+//    This function is the page fault frequency check, run every second 
+//    while the controller is on. It raises the memory allowance of the 
+//    tasks that fault too often and trims the allowance of the tasks that
+//    hardly fault. 
+//
+// INPUTS:
+//
+//    work - the controller work
 //
 // RETURN:
 //
@@ -97,293 +2884,696 @@ struct mp3_task_struct* _lookup_task(long pid)
 //
 // IMPLEMENTATION NOTES
 //
-//   None.  
+//   The fault rate of a task comes from the minor and major fault counters
+//   its sampler keeps. A task starts with its resident set as allowance. 
+//   Above pff_upper faults per second the allowance grows by an eighth 
+//   (at least PFF_MIN_PAGES), taken from the pool; below pff_lower it 
+//   shrinks by as much, down to the working set of the task, and the pages
+//   it borrowed go back to the pool. A trim below the starting allowance 
+//   returns nothing, so the pool never holds more than its size. Every 
+//   raise and trim is logged to the ring as a MP3_RECORD_PFF record; the 
+//   fault rate and resident set of a task stopped by the load control say
+//   nothing, so it is left alone. 
+//   The controller only redistributes allowances: they are published in 
+//   the records and in /proc/mp3/pff, and no memory is limited or 
+//   reclaimed here. Enforcing them, e.g. as memory cgroup limits, is left 
+//   to a userspace agent, which knows how the tasks map to cgroups and 
+//   does not stall the check on reclaim. 
 //
 ///////////////////////////////////////////////////////////////////////////////
-void work_handler (void *arg){
-  // run as long as flag is true
-  if(queue_stop){
+void pff_handler(struct work_struct *work)
+{
+  struct mp3_task_struct *p;
+  struct mp3_record rec;
+  unsigned long flt, rate, rss, floor, step, back;
+  int decision;
+
+  mutex_lock(&mp3_mutex);
+  if(!pff_enabled){
+    mutex_unlock(&mp3_mutex);
     return;
   }
-  unsigned long maj, min, cpu;
-  struct list_head *pos, *tmp;
+  list_for_each_entry(p, &mp3_task_list, task_node)
+  {
+    flt = p->min + p->maj;
+    rate = (flt - p->pff_flt) * HZ / PFF_INTERVAL;
+    p->pff_flt = flt;
+    if(p->mm == NULL || p->suspended)
+      continue;
+    rss = get_mm_rss(p->mm);
+    if(p->pff_allowance == 0){
+      // first check of the task
+      p->pff_allowance = max_t(unsigned long, rss, PFF_MIN_PAGES);
+      continue;
+    }
+    p->pff_rate = rate;
+
+    decision = MP3_PFF_HOLD;
+    step = max_t(unsigned long, p->pff_allowance / 8, PFF_MIN_PAGES);
+    if(rate > pff_upper){
+      if(pff_pool == 0){
+        pff_starved++;
+        continue;
+      }
+      step = min(step, pff_pool);
+      p->pff_allowance += step;
+      p->pff_lent += step;
+      pff_pool -= step;
+      pff_raises++;
+      decision = MP3_PFF_RAISE;
+    }else if(rate < pff_lower){
+      floor = max_t(unsigned long, p->wss_pages, PFF_MIN_PAGES);
+      if(p->pff_allowance <= floor)
+        continue;
+      step = min(step, p->pff_allowance - floor);
+      p->pff_allowance -= step;
+      // only borrowed pages go back, the pool never grows past its size
+      back = min(step, p->pff_lent);
+      p->pff_lent -= back;
+      pff_pool += back;
+      pff_trims++;
+      decision = MP3_PFF_TRIM;
+    }else
+      continue;
+
+    printk(KERN_INFO "PFF: PID %ld at %lu faults/s, allowance %s to %lu pages\n", p->pid, rate, 
+           (decision & MP3_PFF_RAISE) ? "raised" : "trimmed", p->pff_allowance);
+
+    rec.type = MP3_RECORD_PFF;
+    rec.pid = p->tgid;
+    rec.tid = p->pid;
+    rec.time = ktime_to_ns(ktime_get());
+    rec.u.pff.allowance = p->pff_allowance;
+    rec.u.pff.rate = rate;
+    rec.u.pff.rss = rss;
+    rec.u.pff.decision = decision;
+    get_cpu();
+    _stage_record(&rec);
+    put_cpu();
+  }
+  schedule_delayed_work(&pff_work, PFF_INTERVAL);
+  mutex_unlock(&mp3_mutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  pff_control
+//
+// PROCESSING:
+//
+//    This function turns the page fault frequency controller on or off. 
+//
+// INPUTS:
+//
+//    upper   - the faults per second above which an allowance is raised,
+//              0 turns the controller off
+//    lower   - the faults per second below which an allowance is trimmed
+//    pool_mb - the memory the controller can hand out, in MB
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   While the controller is on, a new pool size counts the pages already
+//   lent out. Turning it off gives every allowance back to the pool. It 
+//   must not be called with mp3_mutex held, since it waits for the check. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void pff_control(unsigned long upper, unsigned long lower, unsigned long pool_mb)
+{
   struct mp3_task_struct *p;
-  //unsigned long p_index=0;	// keeps track of the current task
+  long pool = pool_mb << (20 - PAGE_SHIFT);
 
-  // for every item on our list, get the stats
-  list_for_each_safe(pos, tmp, &mp3_task_list)
-  {
-    mutex_lock(&mp3_mutex);
-    p = list_entry(pos, struct mp3_task_struct, task_node);
-    // read the stats and store them on the buffer
-    if(get_cpu_use(p->pid, &min, &maj, &cpu)){
-      // an error occur
-      printk(KERN_INFO "Unable to get stats for pid=%ld\n", p->pid);
-    }else{
-      printk("work_handler: (after get_cpu_use) pid=%lu, jiffies=%lu, min=%lu, maj=%lu, cpu=%lu\n", p->pid, jiffies, min, maj, cpu);
-      // store the sum of information for each PID
-      p->min += min;
-      p->maj += maj;
-      p->cpu += cpu;
-
-      // store the information on the memory buffer
-      *(p_addr + (p_index) + 0) = jiffies;
-      *(p_addr + (p_index) + 1) = p->min;
-      *(p_addr + (p_index) + 2) = p->maj;
-      *(p_addr + (p_index) + 3) = p->cpu;
-      // display the current data
-      printk("work_handler: pid=%lu, jiffies=%lu, min=%lu, maj=%lu, cpu=%lu\n", p->pid, jiffies, p->min, p->maj, p->cpu);
-      printk("work_handler: (p_addr) pid=%ld, jiffies=%lu, min=%lu, maj=%lu, cpu=%lu\n", p->pid, *(p_addr + p_index +0), *(p_addr + p_index + 4), *(p_addr + p_index + 8), *(p_addr + p_index + 12));
-      p_index += 4;
+  mutex_lock(&mp3_mutex);
+  if(upper){
+    pff_upper = upper;
+    pff_lower = lower;
+    list_for_each_entry(p, &mp3_task_list, task_node)
+    {
+      if(!pff_enabled)
+        p->pff_flt = p->min + p->maj;
+      pool -= (long) p->pff_lent;
+    }
+    pff_pool = pool > 0 ? pool : 0;
+    if(!pff_enabled){
+      pff_enabled = 1;
+      schedule_delayed_work(&pff_work, PFF_INTERVAL);
     }
     mutex_unlock(&mp3_mutex);
+    return;
   }
-  // schedule the work queue again
-  schedule_delayed_work(wqueue, HZ/20);
+  pff_enabled = 0;
+  mutex_unlock(&mp3_mutex);
+  cancel_delayed_work_sync(&pff_work);
+
+  mutex_lock(&mp3_mutex);
+  list_for_each_entry(p, &mp3_task_list, task_node)
+    _pff_release(p);
+  pff_pool = 0;
+  mutex_unlock(&mp3_mutex);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// FUNCTION NAME:  create_mp3queue
+// FUNCTION NAME:  proc_pff_read
 //
 // PROCESSING:
 //
-//    This function initializes the work_queue
+//    This function displays the state of the page fault frequency 
+//    controller when the /proc/mp3/pff file is read. 
 //
 // INPUTS:
 //
-//    arg - pointer to data of the work queue 
+//    page 	- the location into which the data is written 
+//    start 	- where the data begins (unused)
+//    off 	- the offset into the page
+//    count 	- the maximum number of characters that can be written 
+//    eof 	- set when all the data has been written 
+//    data 	- unused
 //
 // RETURN:
 //
-//    Nothing.
+//   int - the number of characters written
 //
 // IMPLEMENTATION NOTES
 //
-//   None.  
+//   The controller settings and counters, then one line per task with its
+//   last fault rate, resident set, working set and allowance in pages, and
+//   the pages it borrowed from the pool (negative if it gave some back). 
 //
 ///////////////////////////////////////////////////////////////////////////////
-void create_mp3queue (void) {
-  // initialize the work queue
-  // create the work queue
-  wqueue = kmalloc(sizeof(struct delayed_work), GFP_KERNEL);
-  if(wqueue){
-    INIT_DELAYED_WORK(wqueue, work_handler);
-    printk("Starting the work handler\n");
-    queue_stop=0;
-    p_index=0;
-    // schedule for every 50 milliseconds (20 times per second)
-    schedule_delayed_work(wqueue, HZ/20);
-  }else{
-    // unable to allocate memory for work queue
-    printk("create_mp3queue: Unable to allocate memory for work queue object");
+int proc_pff_read(char *page, char **start, off_t off, int count, int* eof, void* data)
+{
+  struct mp3_task_struct *p;
+  off_t i=0;
+
+  mutex_lock(&mp3_mutex);
+  i += sprintf(page+off+i, "pff %s upper %lu lower %lu pool %lu\n", pff_enabled ? "on" : "off", pff_upper, pff_lower, pff_pool);
+  i += sprintf(page+off+i, "raises %lu trims %lu starved %lu\n", pff_raises, pff_trims, pff_starved);
+  list_for_each_entry(p, &mp3_task_list, task_node)
+  {
+    if(i > PAGE_SIZE - 200)
+      break;
+    i += sprintf(page+off+i, "pid %ld rate %lu rss %lu wss %lu allowance %lu lent %lu\n", p->pid, p->pff_rate, 
+                 p->mm ? get_mm_rss(p->mm) : 0, p->wss_pages, p->pff_allowance, p->pff_lent);
   }
+  mutex_unlock(&mp3_mutex);
+  *eof=1;
+  return i;
 }
+
 ///////////////////////////////////////////////////////////////////////////////
 //
-// FUNCTION NAME:  register_task
+// FUNCTION NAME:  _buffer_alloc
 //
 // PROCESSING:
 //
-//    This funtion implements the task registration
+//    This function allocates a zeroed profiler buffer that can be mapped to
+//    user space. 
 //
 // INPUTS:
 //
-//    pid - 		the process ID of the calling task
-//    period -		the time from when a job of the calling task begins 
-//			executing until the time the next job of the calling task
-//			starts running 
-//    processing time - the total time it takes for a single job to run of the 
-//			calling task to run
+//    size   - the size of the buffer in bytes
+//    contig - set to (1) if the buffer is physically contiguous
+//
+// RETURN:
+//
+//   void * - the buffer, NULL if there is not enough memory
+//
+// IMPLEMENTATION NOTES
+//
+//   A buffer that fits in the largest block of the page allocator is 
+//   taken from it, so the producers reach it through the large pages of 
+//   the kernel linear mapping instead of one TLB entry per page. A larger 
+//   buffer comes from vmalloc. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void *_buffer_alloc(unsigned long size, int *contig)
+{
+  void *addr = NULL;
+
+  if(get_order(size) < MAX_ORDER)
+    addr = alloc_pages_exact(size, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN);
+  *contig = (addr != NULL);
+  if(addr == NULL)
+    addr = vmalloc_user(size);
+  return addr;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _buffer_free
+//
+// PROCESSING:
+//
+//    This function frees a buffer allocated by _buffer_alloc. 
+//
+// INPUTS:
+//
+//    addr   - the buffer
+//    size   - the size of the buffer in bytes
+//    contig - (1) if the buffer is physically contiguous
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   None.
+//
+///////////////////////////////////////////////////////////////////////////////
+void _buffer_free(void *addr, unsigned long size, int contig)
+{
+  if(contig)
+    free_pages_exact(addr, size);
+  else
+    vfree(addr);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  _buffer_attach
+//
+// PROCESSING:
+//
+//    This function lays out a new buffer and points the samplers at its 
+//    rings. 
+//
+// INPUTS:
+//
+//    addr      - the buffer, zeroed
+//    ring_size - the size of the ring of each CPU in bytes
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   The layout page comes first, then one ring per possible CPU. A sampler
+//   is switched to its new ring under its lock, so it never writes half in
+//   the old ring, and once every lock was taken no producer looks at the 
+//   old layout page anymore; the overflow policy is kept. The sampler 
+//   keeps its own head and capacity, the header only gets copies. The 
+//   sequence numbers go on, the new rings start empty. 
+//
+///////////////////////////////////////////////////////////////////////////////
+void _buffer_attach(void *addr, unsigned long ring_size)
+{
+  struct mp3_buffer_layout *layout = (struct mp3_buffer_layout *) addr;
+  struct mp3_buffer_header *h;
+  int cpu;
+
+  layout->magic = MP3_BUFFER_MAGIC;
+  layout->version = MP3_FORMAT_VERSION;
+  layout->record_size = sizeof(struct mp3_record);
+  layout->nr_rings = nr_cpu_ids;
+  layout->ring_offset = PAGE_SIZE;
+  layout->ring_size = ring_size;
+  layout->consumers = mp3_consumers;
+  p_layout = layout;
+
+  // every ring starts with its header page, the records follow
+  for_each_possible_cpu(cpu){
+    struct mp3_cpu_sampler *s = &per_cpu(mp3_samplers, cpu);
+    h = (struct mp3_buffer_header *) ((char *) addr + PAGE_SIZE + cpu * ring_size);
+    h->data_offset = PAGE_SIZE;
+    h->policy = s->policy;
+    mutex_lock(&s->lock);
+    s->header = h;
+    s->records = (struct mp3_record *) ((char *) h + PAGE_SIZE);
+    s->capacity = (ring_size - PAGE_SIZE) / sizeof(struct mp3_record);
+    s->head = 0;
+    s->drops = 0;
+    memset(s->lost, 0, sizeof(s->lost));
+    h->capacity = s->capacity;
+    mutex_unlock(&s->lock);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  resize_buffer
+//
+// PROCESSING:
+//
+//    This function replaces the profiler buffer by one with rings of a new 
+//    size. 
+//
+// INPUTS:
+//
+//    ring_size - the size of the ring of each CPU in bytes
+//
+// RETURN:
+//
+//   int - (0) on success, -EINVAL if the size is out of range, -EBUSY if 
+//         the device is open or mapped, -ENOMEM if there is not enough 
+//         memory
+//
+// IMPLEMENTATION NOTES
+//
+//   The size is rounded up to whole pages. Only done between sessions: 
+//   with no file open and no mapping left, nobody reads the old buffer, 
+//   and open_dev waits on mp3_mutex for the new one. The records still in
+//   the old buffer are lost. 
+//
+///////////////////////////////////////////////////////////////////////////////
+int resize_buffer(unsigned long ring_size)
+{
+  unsigned long size;
+  void *addr, *old;
+  int contig;
+
+  ring_size = PAGE_ALIGN(ring_size);
+  if(ring_size < MP3_MIN_RING_SIZE || ring_size > MP3_MAX_RING_SIZE)
+    return -EINVAL;
+  size = PAGE_SIZE + nr_cpu_ids * ring_size;
+  addr = _buffer_alloc(size, &contig);
+  if(addr == NULL)
+    return -ENOMEM;
+
+  mutex_lock(&mp3_mutex);
+  if(mp3_consumers || atomic_read(&mp3_mappings)){
+    mutex_unlock(&mp3_mutex);
+    _buffer_free(addr, size, contig);
+    return -EBUSY;
+  }
+  _buffer_attach(addr, ring_size);
+  old = p_addr;
+  _buffer_free(old, p_size, p_contig);
+  p_addr = addr;
+  p_size = size;
+  p_contig = contig;
+  mem_size = ring_size;
+  mutex_unlock(&mp3_mutex);
+
+  printk(KERN_INFO "Resized the buffer to %lu KB per ring (%s)\n", ring_size / 1024, contig ? "contiguous" : "vmalloc");
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  mp3_vma_open
+//
+// PROCESSING:
+//
+//    This function counts a new mapping of the profiler buffer. 
+//
+// INPUTS:
+//
+//    vma - the user memory area
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   Called by mp3_mmap and whenever the mapping is copied (fork) or split.
+//
+///////////////////////////////////////////////////////////////////////////////
+void mp3_vma_open(struct vm_area_struct *vma)
+{
+  atomic_inc(&mp3_mappings);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  mp3_vma_close
+//
+// PROCESSING:
+//
+//    This function counts a mapping of the profiler buffer that is gone. 
+//
+// INPUTS:
+//
+//    vma - the user memory area
+//
+// RETURN:
+//
+//   None.
+//
+// IMPLEMENTATION NOTES
+//
+//   None.
+//
+///////////////////////////////////////////////////////////////////////////////
+void mp3_vma_close(struct vm_area_struct *vma)
+{
+  atomic_dec(&mp3_mappings);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  proc_registration_read
+//
+// PROCESSING:
+//
+//    This funtion displays the PID, period, and processing time when the 
+//    /proc/mp2/status file is read. 
+//
+// INPUTS:
+//
+//    page 	- the location into which the user data is being written 
+//    start 	- the argument that specifies when the data begins (when
+//		  returning more than a page of data)
+//    off 	- the argument that specifies where data end (when returning
+//                more than a page of data)
+//    count 	- the maximum number of characters that can be written 
+//    eof 	- the end-of-file argument that is set when all the data
+//		  has been written 
+//    data 	- the private data to be written to the file 
+//
+// RETURN:
+//
+//   int - greater than (0) if there is data to be read in the status file 
+//
+// IMPLEMENTATION NOTES
+//
+//   None.
+//
+///////////////////////////////////////////////////////////////////////////////
+int proc_registration_read(char *page, char **start, off_t off, int count, int* eof, void* data)
+{
+  off_t i=0;
+  struct list_head *pos, *tmp;
+  struct mp3_task_struct *p;
+
+  printk(KERN_INFO "Reading from proc file\n");
+  // should return the number of bytes printed
+
+  mutex_lock(&mp3_mutex);
+  // loop through the task list and print the PID, period and processing time (space delimited)
+  list_for_each_safe(pos, tmp, &mp3_task_list)
+  {
+    p = list_entry(pos, struct mp3_task_struct, task_node);
+    i += sprintf(page+off+i, "%ld\n", p->pid);
+  }
+  mutex_unlock(&mp3_mutex);
+  *eof=1;
+  return i;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME:  proc_stats_read
+//
+// PROCESSING:
+//
+//    This funtion displays the counters of the profiler when the 
+//    /proc/mp3/stats file is read. 
+//
+// INPUTS:
+//
+//    page 	- the location into which the user data is being written 
+//    start 	- the argument that specifies when the data begins
+//    off 	- the argument that specifies where data end
+//    count 	- the maximum number of characters that can be written 
+//    eof 	- the end-of-file argument
+//    data 	- the private data to be written to the file 
 //
 // RETURN:
 //
-//   int - (-1) if there is no task associated with the given PID
-//	    (0) if the task is registered successfully. 
+//   int - the number of characters written
 //
 // IMPLEMENTATION NOTES
 //
-//   The register_task function calls admission control before registering
-//   the specified task in order to verify that it's schedulable. If the task
-//   passes admission control, then the register_task function allocates enough
-//   memory for it, initializes the task structure variables, sets the task 
-//   state to TASK_INTERRUPTIBLE (SLEEPING), initializes the timer, and 
-//   inserts the task into the task list. 
+//   One "name value" pair per line, then one line per CPU ring with its 
+//   counters and the sampling jitter of the CPU (delay from the timer 
+//   expiry to the start of the sampling), then one line per consumer, one
+//   line per profiling target and one line per task with a sample filter. 
 //
 ///////////////////////////////////////////////////////////////////////////////
-int register_task(long pid, long period, long processingTime)
+int proc_stats_read(char *page, char **start, off_t off, int count, int* eof, void* data)
 {
-  struct mp3_task_struct *p;//, *first;
-//  struct list_head *pos, *tmp;
-  
-  //only add if PID doesn't already exist
-  if(_lookup_task(pid) != NULL) return -1;
-  
-  p = kmalloc(sizeof(struct mp3_task_struct), GFP_KERNEL);
-
-  // get the task by given PID
-  p->linux_task = find_task_by_pid(pid);
-  if(p->linux_task == NULL){
-    // no task was found associated with given PID
-    printk(KERN_INFO "No task associated with PID %ld\n", pid);
-    // free the memory
-    kfree(p);
-    // return error
-    return -1;
-  }
-
-  // Update the task structure
-  p->pid = pid;
-  p->min = 0;
-  p->maj = 0;
-  p->cpu = 0;
+  off_t i=0;
+  struct mp3_cpu_sampler *s;
+  struct mp3_task_struct *p;
+  struct mp3_target *t;
+  int cpu, c;
 
   mutex_lock(&mp3_mutex);
-  if(!list_count){
-    create_mp3queue();
+  i += sprintf(page+off+i, "reaped %lu\n", reaped_count);
+  s = &per_cpu(mp3_samplers, 0);
+  i += sprintf(page+off+i, "policy %s\n", s->policy == MP3_DROP_NEWEST ? "drop-newest" : "overwrite-oldest");
+  i += sprintf(page+off+i, "capacity %lu\n", s->capacity);
+  i += sprintf(page+off+i, "ring_kb %lu backing %s\n", mem_size / 1024, p_contig ? "contiguous" : "vmalloc");
+  i += sprintf(page+off+i, "period_us %lu\n", sample_period / NSEC_PER_USEC);
+  i += sprintf(page+off+i, "window_ms %lu\n", agg_window / NSEC_PER_MSEC);
+  i += sprintf(page+off+i, "wake_records %lu\n", wake_records);
+  i += sprintf(page+off+i, "wake_ms %lu\n", wake_ms);
+  i += sprintf(page+off+i, "probed_tasks %d\n", nr_probed);
+  i += sprintf(page+off+i, "wss_pages_per_tick %lu\n", wss_pages_per_tick);
+  i += sprintf(page+off+i, "load_control %s maj_rate %lu cpu_pct %lu\n", lc_enabled ? "on" : "off", lc_maj_rate, lc_cpu_pct);
+  i += sprintf(page+off+i, "suspended %d suspends %lu resumes %lu\n", lc_nr_suspended, lc_suspends, lc_resumes);
+  i += sprintf(page+off+i, "thrashing_secs %lu cpu_ms %llu\n", lc_thrash_secs, div64_u64(lc_thrash_cpu, NSEC_PER_MSEC));
+  i += sprintf(page+off+i, "controlled_secs %lu cpu_ms %llu\n", lc_control_secs, div64_u64(lc_control_cpu, NSEC_PER_MSEC));
+  i += sprintf(page+off+i, "normal_secs %lu cpu_ms %llu\n", lc_normal_secs, div64_u64(lc_normal_cpu, NSEC_PER_MSEC));
+  i += sprintf(page+off+i, "fault_probe_missed %d\n", fault_probe.nmissed);
+  // one line per CPU that samples, while it fits in the page
+  for_each_online_cpu(cpu){
+    s = &per_cpu(mp3_samplers, cpu);
+    if(s->thread == NULL || i > PAGE_SIZE - 200)
+      continue;
+    i += sprintf(page+off+i, "cpu %d tasks %d records %lu drops %lu ticks %lu missed %lu jitter_avg_ns %llu jitter_max_ns %llu stage_drops %lu folded %lu suppressed %lu failed %lu\n", 
+                 cpu, s->nr_tasks, s->head, s->drops, s->ticks, s->missed, 
+                 s->ticks ? div64_u64(s->jitter_total, s->ticks) : 0, s->jitter_max, s->stage_drops, s->folded, s->suppressed, s->failed);
   }
-  mutex_unlock(&mp3_mutex);
-
-  /***NEED MUTEX HERE? *****/
-  // create the work queue job if task list is empty
-/*  list_for_each_safe(pos, tmp, &mp3_task_list)
+  // one line per consumer, with its lag and losses over all the rings
+  for(c = 0; c < MP3_MAX_CONSUMERS; c++){
+    unsigned long lag = 0, lost = 0;
+    if(!(mp3_consumers & (1UL << c)))
+      continue;
+    for_each_possible_cpu(cpu){
+      s = &per_cpu(mp3_samplers, cpu);
+      lag += min(s->head - s->header->tail[c], s->capacity);
+      lost += s->lost[c];
+    }
+    i += sprintf(page+off+i, "consumer %d pid %d lag %lu lost %lu\n", c, consumer_pid[c], lag, lost);
+  }
+  // one line per profiling target
+  list_for_each_entry(t, &mp3_target_list, node)
   {
-    first = list_entry(pos, struct mp3_task_struct, task_node);
-    if(first==NULL)
-      create_mp3queue();
-    break;
+    if(i > PAGE_SIZE - 200)
+      break;
+    i += sprintf(page+off+i, "target %d %s tasks %d\n", t->root, t->kind == MP3_TARGET_TREE ? "tree" : "memcg", t->nr_tasks);
+  }
+  // one line per task with a filter, with the samples it kept out
+  list_for_each_entry(p, &mp3_task_list, task_node)
+  {
+    if((!p->filter_maj && !p->filter_rate && !p->filter_cpu) || i > PAGE_SIZE - 200)
+      continue;
+    i += sprintf(page+off+i, "filter %ld maj %lu rate %lu cpu_us %lu suppressed %lu\n", p->pid, 
+                 p->filter_maj, p->filter_rate, p->filter_cpu / NSEC_PER_USEC, p->suppressed);
   }
-*/
-  // Insert the task into the task list 
-  mutex_lock(&mp3_mutex);
-  _insert_task(p);
-  list_count++;
   mutex_unlock(&mp3_mutex);
-
-
-  printk(KERN_INFO "Task added to list\n");
-  return 0;
+  *eof=1;
+  return i;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// FUNCTION NAME:  unregister_task
+// FUNCTION NAME:  _heat_cmp
 //
 // PROCESSING:
 //
-//    This funtion implements the task de-registration
+//    This function orders heatmap buckets by decreasing fault count. 
 //
 // INPUTS:
 //
-//    pid - the process ID of the calling task
+//    a, b - the buckets to compare
 //
 // RETURN:
 //
-//   int - (-1) if there is no task associated with the given PID
-//	   (0) if the task is registered successfully. 
+//   int - negative if a has more faults than b, positive if less
 //
 // IMPLEMENTATION NOTES
 //
-//   The unregister_task function uses the Linux kernel linked-list
-//   API to search for a given task. If the task is found in the list, the 
-//   memory is freed and the node is removed from the task list. 
+//   Used with sort(). 
 //
 ///////////////////////////////////////////////////////////////////////////////
-int unregister_task(long pid)
+int _heat_cmp(const void *a, const void *b)
 {
-  //struct list_head *pos,*pos2, *tmp, *tmp2;
-  struct list_head *pos, *tmp;
-  struct mp3_task_struct *p;//, *first;
-  int found = -1;  // init to not found
-
-
-  // loop through the list until we find our PID, then remove it
-  list_for_each_safe(pos, tmp, &mp3_task_list)
-  {
-    p = list_entry(pos, struct mp3_task_struct, task_node);
-    // is this is our task?
-    if(p->pid == pid){
-      printk(KERN_INFO "Found node with PID %ld\n", p->pid);
-      // yes, we need to remove this entry
-      mutex_lock(&mp3_mutex);
-      list_del(pos);
-      kfree(p);
-      list_count--;
-      found=0;
-      if(!list_count){
-        queue_stop=1;
-        // need to cancel any pending work
-        cancel_delayed_work(wqueue);
-        kfree(wqueue);
-      }
-      mutex_unlock(&mp3_mutex);
-      printk(KERN_INFO "Removing PID %ld\n", pid);
-    } // no, keep searching
-  }
+  const struct mp3_heat_bucket *x = a, *y = b;
+  unsigned long nx = x->minor + x->major, ny = y->minor + y->major;
 
-  /***NEED MUTEX HERE? *****/
-  // delete the work queue job if task list is empty
-/*  list_for_each_safe(pos2, tmp2, &mp3_task_list)
-  {
-    first = list_entry(pos, struct mp3_task_struct, task_node);
-    if(first==NULL){
-      queue_stop=1;
-      kfree(wqueue);
-    }
-    break;
-  }
-*/
-  // return the result status
-  return found;
+  if(nx == ny)
+    return 0;
+  return nx > ny ? -1 : 1;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 //
-// FUNCTION NAME:  proc_registration_read
+// FUNCTION NAME:  proc_heatmap_read
 //
 // PROCESSING:
 //
-//    This funtion displays the PID, period, and processing time when the 
-//    /proc/mp2/status file is read. 
+//    This funtion displays the fault heatmaps of the registered tasks when 
+//    the /proc/mp3/heatmap file is read. 
 //
 // INPUTS:
 //
 //    page 	- the location into which the user data is being written 
-//    start 	- the argument that specifies when the data begins (when
-//		  returning more than a page of data)
-//    off 	- the argument that specifies where data end (when returning
-//                more than a page of data)
+//    start 	- the argument that specifies when the data begins
+//    off 	- the argument that specifies where data end
 //    count 	- the maximum number of characters that can be written 
-//    eof 	- the end-of-file argument that is set when all the data
-//		  has been written 
+//    eof 	- the end-of-file argument
 //    data 	- the private data to be written to the file 
 //
 // RETURN:
 //
-//   int - greater than (0) if there is data to be read in the status file 
+//   int - the number of characters written
 //
 // IMPLEMENTATION NOTES
 //
-//   None.
+//   One line per task with a heatmap ("pid granularity_kb overflow"), then
+//   one line per range, hottest first: start address, VMA, kind and file
+//   name, minor and major faults. The counts are a snapshot; ranges that 
+//   do not fit in the page are summed up on a last line. 
 //
 ///////////////////////////////////////////////////////////////////////////////
-int proc_registration_read(char *page, char **start, off_t off, int count, int* eof, void* data)
+int proc_heatmap_read(char *page, char **start, off_t off, int count, int* eof, void* data)
 {
-  off_t i=0;
-  struct list_head *pos, *tmp;
+  static const char *kinds[] = { "anon", "heap", "stack", "file" };
+  struct mp3_heat_bucket *snap, *b;
   struct mp3_task_struct *p;
+  off_t i=0;
+  unsigned long overflow;
+  int n, used, shown;
 
-  printk(KERN_INFO "Reading from proc file\n");
-  // should return the number of bytes printed
+  snap = vmalloc(sizeof(((struct mp3_heatmap *) 0)->buckets));
+  if(snap == NULL)
+    return -ENOMEM;
 
   mutex_lock(&mp3_mutex);
-  // loop through the task list and print the PID, period and processing time (space delimited)
-  list_for_each_safe(pos, tmp, &mp3_task_list)
+  list_for_each_entry(p, &mp3_task_list, task_node)
   {
-    p = list_entry(pos, struct mp3_task_struct, task_node);
-    i += sprintf(page+off+i, "%ld\n", p->pid);
+    if(p->heat == NULL || i > PAGE_SIZE - 200)
+      continue;
+    // copy the used buckets and sort them
+    used = 0;
+    spin_lock(&p->heat->lock);
+    for(n = 0; n < MP3_HEAT_BUCKETS; n++){
+      if(p->heat->buckets[n].used)
+        snap[used++] = p->heat->buckets[n];
+    }
+    overflow = p->heat->overflow;
+    spin_unlock(&p->heat->lock);
+    sort(snap, used, sizeof(struct mp3_heat_bucket), _heat_cmp, NULL);
+
+    i += sprintf(page+off+i, "pid %ld granularity_kb %lu overflow %lu\n", p->pid, (1UL << p->heat->shift) / 1024, overflow);
+    for(shown = 0; shown < used && i <= PAGE_SIZE - 200; shown++){
+      b = &snap[shown];
+      i += sprintf(page+off+i, "%lx vma %lx-%lx %s %s minor %lu major %lu\n", b->start, b->vm_start, b->vm_end, kinds[b->kind], b->name[0] ? b->name : "-", b->minor, b->major);
+    }
+    if(shown < used)
+      i += sprintf(page+off+i, "... %d more ranges\n", used - shown);
   }
   mutex_unlock(&mp3_mutex);
+  vfree(snap);
   *eof=1;
   return i;
 }
@@ -405,16 +3595,61 @@ int proc_registration_read(char *page, char **start, off_t off, int count, int*
 //
 // RETURN:
 //
-//   int - the number of characters that were written. 
+//   int - the number of characters that were written, -EINVAL if a value
+//         needed by the action is missing, -EPERM if the caller may not 
+//         perform the action. 
 //
 // IMPLEMENTATION NOTES
 //
 //   The proc_registration_write function processes the message type based on 
-//   the first character. If:
+//   the first character. A PID is taken in the namespace of the writer. 
+//   "Q" and "F" need all three values, "T", "X", "W" and "L" the first two 
+//   and the other actions the first one; "L 0" and "F 0" turn off alone. 
+//   "L", "F", "G", "C", "D", "B", "P", "S", "O", "A" and "W" need 
+//   CAP_SYS_ADMIN: the load control stops any process, a target registers
+//   processes of other users, and the buffer and the sampler settings are
+//   shared by every consumer. "T", "H", "X" and "Q" only act on a task the
+//   caller owns. Anyone can write the file, so the writes are not logged 
+//   and the refused ones only at a limited rate. If:
 //   "R", the function calls the register_task function with the given PID,
 //        period and processing time. 
 //   "Y", the function calls the yield_task function with the given PID
-//   "D", the function calls the unregister_task function with the given PID 
+//   "U", the function calls the unregister_task function with the given PID 
+//   "O", the function sets the overflow policy of the ring buffer (0 for
+//        overwrite-oldest, 1 for drop-newest) 
+//   "P", the function sets the sampling period in microseconds (from 
+//        MP3_MIN_PERIOD_US to MP3_MAX_PERIOD_US) 
+//   "W", the function sets the watermark of poll: the number of unread 
+//        records and the age of the oldest one in milliseconds 
+//   "T", the function traces 1 in N page faults of the given PID (N = 0 
+//        turns tracing off) 
+//   "H", the function keeps a fault heatmap of the given PID with the 
+//        given granularity in KB (0 turns it off, no value uses 2 MB) 
+//   "S", the function sets the page table slots scanned per task and tick
+//        by the working set estimation (0 turns it off) 
+//   "L", the function turns the load control on with the given major fault
+//        rate and cpu utilization thresholds (0 turns it off) 
+//   "Q", the function sets the sample filter of the given PID: a sample is
+//        only stored with at least the given major faults, or faults per 
+//        second, or cpu time in microseconds (0 leaves a threshold out, 
+//        all 0 stores every sample) 
+//   "X", the function turns exact accounting of the given PID on (1) or 
+//        off (0); only the task itself can do so 
+//   "G", the function profiles the given PID and all its descendants, 
+//        registering new children as they are forked 
+//   "C", the function profiles every task in the memory cgroup of the 
+//        given PID, registering tasks as they join 
+//   "D", the function drops the target of the given PID ("G" or "C") and
+//        unregisters its tasks; a task in exact mode stays registered 
+//        until it turns exact mode off and is unregistered, or exits 
+//   "B", the function sets the size of the ring of each CPU in KB (from 
+//        MP3_MIN_RING_SIZE to MP3_MAX_RING_SIZE); only while the device is
+//        neither open nor mapped 
+//   "A", the function sets the aggregation window in milliseconds (up to 
+//        MP3_MAX_WINDOW_MS, 0 stores every sample) 
+//   "F", the function turns the page fault frequency controller on with 
+//        the given upper and lower fault rates and pool size in MB (0 turns
+//        it off) 
 //
 ///////////////////////////////////////////////////////////////////////////////
 int proc_registration_write(struct file *file, const char *buffer, unsigned long count, void *data)
@@ -424,14 +3659,55 @@ int proc_registration_write(struct file *file, const char *buffer, unsigned long
   long pid, processingTime;
   int status;
   long period;
+  int args, need, denied = 0;
 
-  printk(KERN_INFO "Writing to proc file\n");
-
-  proc_buffer=kmalloc(count, GFP_KERNEL);
-  action=kmalloc(2, GFP_KERNEL);
+  // the action is at most as long as the whole write
+  proc_buffer=kmalloc(count+1, GFP_KERNEL);
+  action=kmalloc(count+1, GFP_KERNEL);
+  if(proc_buffer == NULL || action == NULL){
+    kfree(proc_buffer);
+    kfree(action);
+    return -ENOMEM;
+  }
   status=copy_from_user(proc_buffer, buffer, count);
-  sscanf(proc_buffer, "%s %ld %ld %ld", action, &pid, &period, &processingTime);
-  printk(KERN_INFO "From /proc/mp3/status: %s, %ld, %ld, %ld\n", action, pid, period, processingTime); 
+  if(status){
+    kfree(proc_buffer);
+    kfree(action);
+    return -EFAULT;
+  }
+  proc_buffer[count]='\0';
+  action[0]='\0';
+  period = 0;
+  processingTime = 0;
+  args = sscanf(proc_buffer, "%s %ld %ld %ld", action, &pid, &period, &processingTime);
+
+  // refuse a write that misses a value of its action
+  if(action[0] != '\0' && strchr("QF", action[0]) != NULL)
+    need = 4;
+  else if(action[0] != '\0' && strchr("TXWL", action[0]) != NULL)
+    need = 3;
+  else
+    need = 2;
+  if((action[0] == 'L' || action[0] == 'F') && args >= 2 && pid == 0)
+    need = 2;
+  if(args < need){
+    printk_ratelimited(KERN_INFO "Missing values in the write to /proc/mp3/status\n");
+    kfree(proc_buffer);
+    kfree(action);
+    return -EINVAL;
+  }
+
+  // the tasks are registered by their global PID
+  if(action[0] != '\0' && strchr("RUQXTHGCD", action[0]) != NULL && pid > 0)
+    pid = _global_pid(pid);
+
+  // these act on processes of other users or on the whole profiler
+  if(action[0] != '\0' && strchr("LFGCDBPSOAW", action[0]) != NULL && !capable(CAP_SYS_ADMIN)){
+    printk_ratelimited(KERN_INFO "%s needs CAP_SYS_ADMIN\n", action);
+    kfree(proc_buffer);
+    kfree(action);
+    return -EPERM;
+  }
 
   if(strcmp(action, "R")==0){
     printk(KERN_INFO "Going to register PID %ld\n", pid);
@@ -443,11 +3719,155 @@ int proc_registration_write(struct file *file, const char *buffer, unsigned long
     // perform de-registration
     unregister_task(pid);
   }
+  if(strcmp(action, "O")==0){
+    // the value is read into pid
+    if(pid == MP3_OVERWRITE_OLDEST || pid == MP3_DROP_NEWEST){
+      int cpu;
+      printk(KERN_INFO "Setting the overflow policy to %ld\n", pid);
+      for_each_possible_cpu(cpu){
+        per_cpu(mp3_samplers, cpu).policy = pid;
+        per_cpu(mp3_samplers, cpu).header->policy = pid;
+      }
+    }
+  }
+  if(strcmp(action, "P")==0){
+    // the value is read into pid
+    if(pid >= MP3_MIN_PERIOD_US && pid <= MP3_MAX_PERIOD_US){
+      printk(KERN_INFO "Setting the sampling period to %ld us\n", pid);
+      sample_period = pid * NSEC_PER_USEC;
+    }
+  }
+  if(strcmp(action, "Q")==0){
+    struct mp3_task_struct *p;
+    long cpu_us;
+    // the major faults and fault rate are read into period and processingTime
+    if(sscanf(proc_buffer, "%*s %*d %*d %*d %ld", &cpu_us) < 1)
+      cpu_us = 0;
+    mutex_lock(&mp3_mutex);
+    p = _lookup_task(pid);
+    if(p != NULL && !_task_owned(p)){
+      printk_ratelimited(KERN_INFO "%s needs to own PID %ld\n", action, pid);
+      denied = 1;
+      p = NULL;
+    }
+    if(p != NULL && period >= 0 && processingTime >= 0 && cpu_us >= 0){
+      printk(KERN_INFO "Filtering PID %ld: %ld major faults, %ld faults/s or %ld us of cpu\n", pid, period, processingTime, cpu_us);
+      p->filter_maj = period;
+      p->filter_rate = processingTime;
+      p->filter_cpu = cpu_us * NSEC_PER_USEC;
+    }
+    mutex_unlock(&mp3_mutex);
+  }
+  if(strcmp(action, "X")==0){
+    struct mp3_task_struct *p;
+    // the mode is read into period
+    mutex_lock(&mp3_mutex);
+    p = _lookup_task(pid);
+    if(p != NULL && !_task_owned(p)){
+      printk_ratelimited(KERN_INFO "%s needs to own PID %ld\n", action, pid);
+      denied = 1;
+      p = NULL;
+    }
+    if(p != NULL && exact_task(p, period != 0) == 0)
+      printk(KERN_INFO "Exact accounting of PID %ld is %s\n", pid, period ? "on" : "off");
+    else
+      printk(KERN_INFO "Unable to change the accounting of PID %ld\n", pid);
+    mutex_unlock(&mp3_mutex);
+  }
+  if(strcmp(action, "G")==0 || strcmp(action, "C")==0){
+    printk(KERN_INFO "Profiling the %s of PID %ld\n", action[0] == 'G' ? "process tree" : "memory cgroup", pid);
+    if(add_target(action[0] == 'G' ? MP3_TARGET_TREE : MP3_TARGET_CGROUP, pid))
+      printk(KERN_INFO "Unable to profile the %s of PID %ld\n", action[0] == 'G' ? "process tree" : "memory cgroup", pid);
+  }
+  if(strcmp(action, "D")==0){
+    if(pid > 0)
+      drop_target(pid);
+  }
+  if(strcmp(action, "B")==0){
+    // the value is read into pid
+    if(pid > 0){
+      status = resize_buffer(pid * 1024UL);
+      if(status)
+        printk(KERN_INFO "Unable to resize the buffer to %ld KB per ring (error %d)\n", pid, status);
+    }
+  }
+  if(strcmp(action, "A")==0){
+    // the value is read into pid
+    if(pid >= 0 && pid <= MP3_MAX_WINDOW_MS){
+      printk(KERN_INFO "Setting the aggregation window to %ld ms\n", pid);
+      agg_window = pid * NSEC_PER_MSEC;
+    }
+  }
+  if(strcmp(action, "T")==0){
+    struct mp3_task_struct *p;
+    // the sampling rate is read into period
+    mutex_lock(&mp3_mutex);
+    p = _lookup_task(pid);
+    if(p != NULL && !_task_owned(p)){
+      printk_ratelimited(KERN_INFO "%s needs to own PID %ld\n", action, pid);
+      denied = 1;
+      p = NULL;
+    }
+    if(p != NULL && period >= 0){
+      printk(KERN_INFO "Tracing 1 in %ld faults of PID %ld\n", period, pid);
+      trace_task(p, period);
+    }
+    mutex_unlock(&mp3_mutex);
+  }
+  if(strcmp(action, "H")==0){
+    struct mp3_task_struct *p;
+    // the granularity is read into period
+    if(sscanf(proc_buffer, "%*s %*d %ld", &period) < 1)
+      period = MP3_HEAT_DEFAULT_KB;
+    mutex_lock(&mp3_mutex);
+    p = _lookup_task(pid);
+    if(p != NULL && !_task_owned(p)){
+      printk_ratelimited(KERN_INFO "%s needs to own PID %ld\n", action, pid);
+      denied = 1;
+      p = NULL;
+    }
+    if(p != NULL && period >= 0){
+      printk(KERN_INFO "Heatmap of PID %ld with %ld KB ranges\n", pid, period);
+      heat_task(p, period);
+    }
+    mutex_unlock(&mp3_mutex);
+  }
+  if(strcmp(action, "S")==0){
+    // the value is read into pid
+    if(pid >= 0){
+      printk(KERN_INFO "Scanning %ld pages per tick for the working set\n", pid);
+      wss_pages_per_tick = pid;
+    }
+  }
+  if(strcmp(action, "L")==0){
+    // the thresholds are read into pid and period
+    if(pid == 0)
+      load_control(0, 0);
+    else if(pid > 0 && period >= 0 && period <= 100)
+      load_control(pid, period);
+  }
+  if(strcmp(action, "F")==0){
+    // the fault rates and the pool are read into pid, period and processingTime
+    if(pid == 0)
+      pff_control(0, 0, 0);
+    else if(pid > 0 && period >= 0 && period < pid && processingTime >= 0){
+      printk(KERN_INFO "PFF control between %ld and %ld faults/s with %ld MB\n", period, pid, processingTime);
+      pff_control(pid, period, processingTime);
+    }
+  }
+  if(strcmp(action, "W")==0){
+    // the values are read into pid and period
+    if(pid > 0 && period >= 0){
+      printk(KERN_INFO "Setting the watermark to %ld records or %ld ms\n", pid, period);
+      wake_records = pid;
+      wake_ms = period;
+    }
+  }
   // free the memory
   kfree(proc_buffer);
   kfree(action);
 
-  return count;
+  return denied ? -EPERM : count;
 }
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -464,15 +3884,62 @@ int proc_registration_write(struct file *file, const char *buffer, unsigned long
 //
 // RETURN:
 //
-//   0
+//   0 on success, -ENOMEM if the reader cannot be allocated, -EBUSY if all
+//   the consumer slots are in use.
 //
 // IMPLEMENTATION NOTES
 //
-//   Function is only defined and does not do any processing. 
+//   Every open file is a consumer with its own slot. Its tail in every ring
+//   starts at the oldest record still in the ring, and its loss counters 
+//   start at zero. The slot is added to the consumer mask last, so the 
+//   producer never sees a used slot with a stale tail. The mask is kept by
+//   the kernel under mp3_mutex; the layout page only gets a copy, since it
+//   is mapped writable. 
 //
 ///////////////////////////////////////////////////////////////////////////////
 int open_dev(struct inode *inode, struct file *filep)
 {
+    struct mp3_reader *r;
+    struct mp3_cpu_sampler *s;
+    int cpu, c;
+
+    r = kzalloc(sizeof(struct mp3_reader), GFP_KERNEL);
+    if(r == NULL)
+      return -ENOMEM;
+    r->bounce = kmalloc(MP3_READ_BATCH * sizeof(struct mp3_record), GFP_KERNEL);
+    if(r->bounce == NULL){
+      kfree(r);
+      return -ENOMEM;
+    }
+    mutex_init(&r->lock);
+
+    mutex_lock(&mp3_mutex);
+    for(c = 0; c < MP3_MAX_CONSUMERS; c++){
+      if(!(mp3_consumers & (1UL << c)))
+        break;
+    }
+    if(c == MP3_MAX_CONSUMERS){
+      mutex_unlock(&mp3_mutex);
+      kfree(r->bounce);
+      kfree(r);
+      return -EBUSY;
+    }
+    for_each_possible_cpu(cpu){
+      s = &per_cpu(mp3_samplers, cpu);
+      s->header->tail[c] = s->head - min(s->head, s->capacity);
+      s->lost[c] = 0;
+      s->header->lost[c] = 0;
+    }
+    consumer_pid[c] = current->tgid;
+    smp_wmb();
+    mp3_consumers |= 1UL << c;
+    p_layout->consumers = mp3_consumers;
+    mutex_unlock(&mp3_mutex);
+    // the age of the records is checked while a consumer is open
+    schedule_delayed_work(&wake_work, WAKE_INTERVAL);
+
+    r->slot = c;
+    filep->private_data = r;
     return 0;
 }
 
@@ -496,48 +3963,168 @@ int open_dev(struct inode *inode, struct file *filep)
 //
 // IMPLEMENTATION NOTES
 //
-//   Function is only defined and does not do any processing. 
+//   Releases the consumer slot of the file and frees its reader. 
 //
 ///////////////////////////////////////////////////////////////////////////////
 int close_dev(struct inode *inode, struct file *filep)
 {
+    struct mp3_reader *r = filep->private_data;
+
+    mutex_lock(&mp3_mutex);
+    mp3_consumers &= ~(1UL << r->slot);
+    p_layout->consumers = mp3_consumers;
+    mutex_unlock(&mp3_mutex);
+    kfree(r->bounce);
+    kfree(r);
     return 0;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: _read_ring
+//
+// PROCESSING:
+//
+//	  This function copies the unread records of one ring to user space. 
+//
+// INPUTS:
+//
+//    r    - the reader of the file
+//    s    - the sampler that owns the ring
+//    buff - user buffer to copy the records to
+//    max  - the maximum number of records to copy
+//
+// RETURN:
+//
+//   The number of records copied, or -EFAULT if none could be copied.
+//
+// IMPLEMENTATION NOTES
+//
+//   The sampler lock is not taken, so a reader that faults on its buffer 
+//   never stalls the sampling thread; the ring cannot be replaced while 
+//   the device is open. The records are copied to the bounce buffer of the
+//   reader, a batch at a time, and the head is read again afterwards: with
+//   MP3_OVERWRITE_OLDEST the slots that the producer may have rewritten 
+//   meanwhile are left out, the same way the mmap consumer does it. Only 
+//   intact records reach copy_to_user. Records overwritten before the 
+//   reader got to them are skipped; the producer already counted them as 
+//   lost for the slot. The tail of the slot is the cursor of the file. 
+//   Called with the lock of the reader held. 
+//
+///////////////////////////////////////////////////////////////////////////////
+long _read_ring(struct mp3_reader *r, struct mp3_cpu_sampler *s, char *buff, unsigned long max)
+{
+  struct mp3_buffer_header *h = s->header;
+  unsigned long head, index, slot, span, n, skip;
+  unsigned long copied = 0;
+  long ret = 0;
+
+  index = h->tail[r->slot];
+  while(copied < max){
+    head = ACCESS_ONCE(s->head);
+    smp_rmb();
+    if(head - index > s->capacity)
+      index = head - s->capacity;
+    if(index == head)
+      break;
+    n = min(head - index, max - copied);
+    n = min(n, (unsigned long) MP3_READ_BATCH);
+    slot = index % s->capacity;
+    span = min(n, s->capacity - slot);
+    memcpy(r->bounce, &s->records[slot], span * sizeof(struct mp3_record));
+    memcpy(r->bounce + span, s->records, (n - span) * sizeof(struct mp3_record));
+
+    // the copy is only valid for the slots that were not rewritten meanwhile
+    smp_rmb();
+    head = ACCESS_ONCE(s->head);
+    skip = 0;
+    if(s->policy == MP3_OVERWRITE_OLDEST && head - index >= s->capacity)
+      skip = min(head - s->capacity + 1 - index, n);
+    if(copy_to_user(buff + copied * sizeof(struct mp3_record), r->bounce + skip, (n - skip) * sizeof(struct mp3_record))){
+      ret = -EFAULT;
+      break;
+    }
+    index += n;
+    copied += n - skip;
+  }
+  // the slots can be reused by the profiler
+  h->tail[r->slot] = index;
+  return (ret && copied == 0) ? ret : copied;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // FUNCTION NAME: mp3_read
 //
 // PROCESSING:
 //
-//	  Callback handler for the device read function. 
+//	  Callback handler for the device read function; it copies whole 
+//	  records from the rings to the caller. 
 //
 // INPUTS:
 //
 //    filp  - The pointer to file
 //    buff - buffer to write information to
-//    len - size of data to read
+//    len - size of the buffer
 //    off - offset
 //    
 //
 // RETURN:
 //
-//   The size of the data.
+//   The number of bytes read (a multiple of the record size), -EINVAL if 
+//   the buffer cannot hold one record, -EAGAIN if there is nothing to read
+//   and the file is non blocking, or another negative error code.
 //
 // IMPLEMENTATION NOTES
 //
-//   Function is only defined and does not do any processing. 
+//   The rings are read one after the other, starting after the ring that
+//   was read last so that a busy CPU does not starve the others. Records 
+//   are in order within a ring; a consumer that needs a global order sorts
+//   them by time stamp. A blocking read sleeps until the watermark is 
+//   reached. There is no splice_read: splice and sendfile fall back to 
+//   default_file_splice_read, which uses this function with kernel pages,
+//   so the profile can be streamed to a file without a user buffer. 
 //
 ///////////////////////////////////////////////////////////////////////////////
 ssize_t mp3_read(struct file* filp, char *buff, size_t len, loff_t *off){
-  short count = 0;
-  int i=0;
-  while(len && (*(p_addr+i) != 0)){
-    put_user(*(p_addr+i), buff++);
-    count++;
-    len--;
-    i++;
+  struct mp3_reader *r = filp->private_data;
+  unsigned long max = len / sizeof(struct mp3_record);
+  unsigned long copied = 0;
+  long ret;
+  int cpu, n;
+
+  if(max == 0)
+    return -EINVAL;
+
+  if(mutex_lock_interruptible(&r->lock))
+    return -ERESTARTSYS;
+  while(1){
+    cpu = r->next_ring;
+    for(n = 0; n < nr_cpu_ids && copied < max; n++){
+      cpu = (cpu + 1) % nr_cpu_ids;
+      if(!cpu_possible(cpu))
+        continue;
+      ret = _read_ring(r, &per_cpu(mp3_samplers, cpu), buff + copied * sizeof(struct mp3_record), max - copied);
+      if(ret < 0){
+        mutex_unlock(&r->lock);
+        return ret;
+      }
+      copied += ret;
+      r->next_ring = cpu;
+    }
+    if(copied)
+      break;
+    mutex_unlock(&r->lock);
+    if(filp->f_flags & O_NONBLOCK)
+      return -EAGAIN;
+    if(wait_event_interruptible(mp3_waitq, _records_ready(r->slot)))
+      return -ERESTARTSYS;
+    if(mutex_lock_interruptible(&r->lock))
+      return -ERESTARTSYS;
   }
-  return count;
+  mutex_unlock(&r->lock);
+  *off += copied * sizeof(struct mp3_record);
+  return copied * sizeof(struct mp3_record);
 }
 ///////////////////////////////////////////////////////////////////////////////
 //
@@ -545,54 +4132,116 @@ ssize_t mp3_read(struct file* filp, char *buff, size_t len, loff_t *off){
 //
 // PROCESSING:
 //
+//	  Callback handler for the device mmap function; it maps the profiler 
+//	  buffer into the address space of the calling process. 
 //
 // INPUTS:
 //
-//    None.
+//    filp - The pointer to file
+//    vma  - The user memory area to map the buffer to
 //
 // RETURN:
 //
-//   None. 
+//   0 on success, a negative error code if the area is larger than the 
+//   buffer. 
 //
 // IMPLEMENTATION NOTES
 //
+//   A contiguous buffer is mapped as one range of page frames, a vmalloc 
+//   buffer page by page with remap_vmalloc_range. Mappings are counted, so
+//   the buffer is not resized under them. The consumer reads the records 
+//   in place: the layout page tells it where the ring of each CPU is, the
+//   ring header tells it where the head is and it writes back the tail of
+//   its consumer slot when it is done. 
 //
 ///////////////////////////////////////////////////////////////////////////////
 int mp3_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-  unsigned long pfn=0;
-  int i;
-  int ret =0;
-  //unsigned long start=vma->vm_start;
-  //unsigned long length = mem_size;
-  //int*  vmalloc_area_ptr = p_addr;
-/*
-  while(length > 0){
-    pfn = vmalloc_to_pfn(vmalloc_area_ptr);
-    if((ret = remap_pfn_range(vma, start, pfn, PAGE_SIZE, PAGE_SHARED)) < 0){
-      printk("Error in remap %d\n", ret);
-      return ret;
-    }else{
-      printk("No error (length=%ld)\n", length);
-    }
-    start += PAGE_SIZE;
-    vmalloc_area_ptr += PAGE_SIZE;
-    length -= PAGE_SIZE;
+  int ret;
+
+  if(!p_contig)
+    ret = remap_vmalloc_range(vma, p_addr, vma->vm_pgoff);
+  else if((vma->vm_pgoff << PAGE_SHIFT) + (vma->vm_end - vma->vm_start) > p_size)
+    ret = -EINVAL;
+  else
+    ret = remap_pfn_range(vma, vma->vm_start, (virt_to_phys(p_addr) >> PAGE_SHIFT) + vma->vm_pgoff, 
+                          vma->vm_end - vma->vm_start, vma->vm_page_prot);
+  if(ret < 0){
+    printk("mmap: unable to map the buffer (error %d)\n", ret);
+    return ret;
   }
-*/
-  //mutex_lock(&mp3_mutex);
-  for(i=0; i < mem_size; i+= PAGE_SIZE)
-  {
-//    pfn = vmalloc_to_pfn(p_addr+i);
-    printk("mmap: i=%d, pfn=%lu\n", i, *(p_addr+i));
-//    if(!pfn)
-//      ret = remap_pfn_range(vma, vma->vm_start + i, pfn, PAGE_SIZE, PAGE_SHARED);
-    if(ret < 0) return ret;
-  }
-  //mutex_unlock(&mp3_mutex);
-  printk("start address: %lu, end address: %lu\n", vma->vm_start, vma->vm_end);
-  return vma->vm_start;
-  
+  vma->vm_ops = &mp3_vm_ops;
+  mp3_vma_open(vma);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: mp3_poll
+//
+// PROCESSING:
+//
+//	  Callback handler for the device poll function. 
+//
+// INPUTS:
+//
+//    filp - The pointer to file
+//    wait - The poll table of the caller
+//
+// RETURN:
+//
+//   POLLIN | POLLRDNORM if the unread records reached the watermark, 0 
+//   otherwise.
+//
+// IMPLEMENTATION NOTES
+//
+//   The readiness is level triggered: it holds until the consumer moves the
+//   tail of its slot forward. The sampling threads and the age check of 
+//   wake_handler wake up the wait queue when the watermark is reached, so
+//   a consumer sleeping in poll costs nothing. 
+//
+///////////////////////////////////////////////////////////////////////////////
+unsigned int mp3_poll(struct file *filp, poll_table *wait)
+{
+  struct mp3_reader *r = filp->private_data;
+
+  poll_wait(filp, &mp3_waitq, wait);
+  if(_records_ready(r->slot))
+    return POLLIN | POLLRDNORM;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// FUNCTION NAME: mp3_ioctl
+//
+// PROCESSING:
+//
+//	  Callback handler for the device ioctl function. 
+//
+// INPUTS:
+//
+//    filp - The pointer to file
+//    cmd  - The command (MP3_IOC_CONSUMER)
+//    arg  - Not used
+//
+// RETURN:
+//
+//   The consumer slot of the file for MP3_IOC_CONSUMER, -ENOTTY for any 
+//   other command.
+//
+// IMPLEMENTATION NOTES
+//
+//   A mmap consumer needs its slot to know which tail of the rings to use.
+//
+///////////////////////////////////////////////////////////////////////////////
+long mp3_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  struct mp3_reader *r = filp->private_data;
+
+  if(cmd == MP3_IOC_CONSUMER)
+    return r->slot;
+  return -ENOTTY;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -628,6 +4277,11 @@ void _destroy_task_list(void)
       //remove from list
       list_del(pos);
       printk(KERN_INFO "Destroying task associated with PID %ld\n", p->pid);
+      if(p->heat)
+        vfree(p->heat);
+      if(p->mm)
+        mmput(p->mm);
+      put_task_struct(p->linux_task);
       kfree(p);
     }
 }
@@ -647,41 +4301,101 @@ void _destroy_task_list(void)
 //
 // RETURN:
 //
-//   int - returns 0 
+//   int - returns 0 on success, a negative error code otherwise
 //
 // IMPLEMENTATION NOTES
 //
-//   It initializes the proc_file entry variables and creates the dispatcher
-//   thread.
+//   It initializes the proc_file entry variables and the per-CPU samplers,
+//   and creates the sampling thread of every online CPU.
 //	 The profiler memory buffer is also allocated here to store work process
-//	 information. 
+//	 information; it holds one ring per possible CPU. The ring size is
+//   checked and every allocation made before the proc entries and the exit
+//   notifier are registered, so a failure only frees the allocations. 
 //   
 ///////////////////////////////////////////////////////////////////////////////
 int __init my_module_init(void)
 {
+  struct sched_param sparam;
+  int cpu, ret;
+
+  // the layout page, then one ring of mem_size bytes per possible CPU
+  mem_size = PAGE_ALIGN(mem_size);
+  if(mem_size < MP3_MIN_RING_SIZE || mem_size > MP3_MAX_RING_SIZE){
+    printk("Invalid ring size %lu\n", mem_size);
+    return -EINVAL;
+  }
+
+  // unregistered tasks are freed from a queue of their own
+  mp3_free_wq = create_singlethread_workqueue("kmp3_free");
+  if(mp3_free_wq == NULL){
+    printk("Unable to create the free queue\n");
+    return -ENOMEM;
+  }
+
+  // Allocate memory buffer (zeroed and mappable to user space)
+  p_size = PAGE_SIZE + nr_cpu_ids * mem_size;
+  p_addr = _buffer_alloc(p_size, &p_contig);
+  if(!p_addr){
+    printk("Unable to allocate the memory (size=%ld)\n", p_size);
+    ret = -ENOMEM;
+    goto out_wq;
+  }
+  printk("Allocated memory (size=%ld, %d rings, %s)\n", p_size, nr_cpu_ids, p_contig ? "contiguous" : "vmalloc");
+
+  for_each_possible_cpu(cpu){
+    struct mp3_cpu_sampler *s = &per_cpu(mp3_samplers, cpu);
+    s->cpu = cpu;
+    mutex_init(&s->lock);
+    INIT_LIST_HEAD(&s->tasks);
+    hrtimer_init(&s->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_PINNED);
+    s->timer.function = sample_timer_handler;
+    s->stage = kmalloc(MP3_STAGE_SIZE * sizeof(struct mp3_record), GFP_KERNEL);
+    init_irq_work(&s->kick, _kick_thread);
+    if(s->stage == NULL){
+      printk("Unable to allocate the stage of CPU %d\n", cpu);
+      ret = -ENOMEM;
+      goto out_stage;
+    }
+  }
+
+  _buffer_attach(p_addr, mem_size);
+
+  INIT_DELAYED_WORK(&lc_work, lc_handler);
+  INIT_DELAYED_WORK(&pff_work, pff_handler);
+  INIT_DELAYED_WORK(&target_work, target_handler);
+  INIT_WORK(&target_scan_work, target_scan_handler);
+  INIT_WORK(&reap_work, reap_handler);
+  INIT_DELAYED_WORK(&wake_work, wake_handler);
+
+  // nothing can fail past this point, so the interfaces come up last
   mp3_proc_dir=proc_mkdir("mp3",NULL);
   register_task_file=create_proc_entry("status", 0666, mp3_proc_dir);
   register_task_file->read_proc= proc_registration_read;
   register_task_file->write_proc=proc_registration_write;
+  stats_file=create_proc_entry("stats", 0444, mp3_proc_dir);
+  stats_file->read_proc= proc_stats_read;
+  heatmap_file=create_proc_entry("heatmap", 0444, mp3_proc_dir);
+  heatmap_file->read_proc= proc_heatmap_read;
+  pff_file=create_proc_entry("pff", 0444, mp3_proc_dir);
+  pff_file->read_proc= proc_pff_read;
 
-  // Allocate memory buffer
-  p_addr = vmalloc(mem_size);
-  if(!p_addr){
-    printk("Unable to allocate the memory (size=%ld)\n", mem_size);
-    return -1;
-  }
-  printk("Allocated memory (size=%ld)\n", mem_size);
-  int i;
-  // set the PG_reserved bit
-  struct page* apage;
-  for(i=0; i < mem_size; i+= PAGE_SIZE)
-  {
-    apage = vmalloc_to_page(p_addr+i);
-    if(apage != NULL)
-      SetPageReserved(apage);
-  }
-  memset(p_addr, 0, mem_size);
+  // unregister tasks that exit without unregistering
+  profile_event_register(PROFILE_TASK_EXIT, &task_exit_nb);
 
+  // one high priority sampling thread bound to every online CPU
+  sparam.sched_priority = MAX_RT_PRIO - 1;
+  for_each_online_cpu(cpu){
+    struct mp3_cpu_sampler *s = &per_cpu(mp3_samplers, cpu);
+    s->thread = kthread_create(sample_thread, s, "kmp3/%d", cpu);
+    if(IS_ERR(s->thread)){
+      printk("Unable to create the sampling thread of CPU %d\n", cpu);
+      s->thread = NULL;
+      continue;
+    }
+    kthread_bind(s->thread, cpu);
+    sched_setscheduler(s->thread, SCHED_FIFO, &sparam);
+    wake_up_process(s->thread);
+  }
 
   // register the character device 
   if(!register_chrdev(693, "mp3_char_device", &mp3_fops))
@@ -693,6 +4407,16 @@ int __init my_module_init(void)
   //THE EQUIVALENT TO PRINTF IN KERNEL SPACE
   printk(KERN_INFO "MP3 Module LOADED\n");
   return 0;   
+
+out_stage:
+  for_each_possible_cpu(cpu){
+    kfree(per_cpu(mp3_samplers, cpu).stage);
+    per_cpu(mp3_samplers, cpu).stage = NULL;
+  }
+  _buffer_free(p_addr, p_size, p_contig);
+out_wq:
+  destroy_workqueue(mp3_free_wq);
+  return ret;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -714,34 +4438,65 @@ int __init my_module_init(void)
 // IMPLEMENTATION NOTES
 //
 //   The my_module_exit function removes the proc filesystem entries and 
-//   deallocates memory. 
+//   deallocates memory. Every work, timer and thread is stopped 
+//   synchronously before the memory it uses is freed. 
 //   
 ///////////////////////////////////////////////////////////////////////////////
 void __exit my_module_exit(void)
 {
+  int cpu;
+
+  profile_event_unregister(PROFILE_TASK_EXIT, &task_exit_nb);
+  // stop following the profiling targets
+  drop_target(0);
+  cancel_delayed_work_sync(&target_work);
+  cancel_work_sync(&target_scan_work);
+  // continue the tasks stopped by the load control
+  load_control(0, 0);
+  // stop the fault frequency controller
+  pff_control(0, 0, 0);
+
   remove_proc_entry("status", mp3_proc_dir);
+  remove_proc_entry("stats", mp3_proc_dir);
+  remove_proc_entry("heatmap", mp3_proc_dir);
+  remove_proc_entry("pff", mp3_proc_dir);
   remove_proc_entry("mp3", NULL);
+
+  // wait for the tasks unregistered so far to be freed, while the sampling
+  // threads can still take their last records
+  rcu_barrier();
+  flush_workqueue(mp3_free_wq);
+
+  // stop tracing faults
+  mutex_lock(&mp3_mutex);
+  if(nr_probed)
+    unregister_kretprobe(&fault_probe);
+  nr_probed = 0;
+  mutex_unlock(&mp3_mutex);
   
-  // need to stop the workqueue and free memory
-  queue_stop=1;
-  if(list_count)
-    kfree(wqueue);
+  // need to stop the sampling timer and thread of every CPU
+  for_each_possible_cpu(cpu){
+    struct mp3_cpu_sampler *s = &per_cpu(mp3_samplers, cpu);
+    hrtimer_cancel(&s->timer);
+    irq_work_sync(&s->kick);
+    if(s->thread)
+      kthread_stop(s->thread);
+    s->thread = NULL;
+    kfree(s->stage);
+  }
+  // the sampling threads no longer queue the reap work, and the tasks it
+  // unregistered are freed by the free workqueue before it is destroyed
+  cancel_work_sync(&reap_work);
+  cancel_delayed_work_sync(&wake_work);
+  rcu_barrier();
 
   // deregister the character device 
   unregister_chrdev(693, "mp3_char_device");
   
   _destroy_task_list();
+  destroy_workqueue(mp3_free_wq);
   
-  int i;
-  // set the PG_reserved bit
-  struct page* apage;
-  for(i=0; i < mem_size; i+= PAGE_SIZE)
-  {
-    apage = vmalloc_to_page(p_addr+i);
-    if(apage != NULL)
-      ClearPageReserved(vmalloc_to_page(p_addr+i));
-  }
-  vfree(p_addr);   // deallocate profile buffer 
+  _buffer_free(p_addr, p_size, p_contig);   // deallocate profile buffer 
   printk(KERN_INFO "MP3 Module UNLOADED\n");
 }
 
@@ -751,4 +4506,6 @@ module_init(my_module_init);
 module_exit(my_module_exit);
 
 // THIS IS REQUIRED BY THE KERNEL
+module_param(mem_size, ulong, 0444);
+MODULE_PARM_DESC(mem_size, "bytes of the ring of each CPU, rounded up to pages");
 MODULE_LICENSE("GPL");
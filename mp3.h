@@ -25,50 +25,359 @@
 #include <linux/vmalloc.h>
 #include <linux/workqueue.h>
 #include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/smp.h>
+#include <linux/math64.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/kprobes.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include <linux/log2.h>
+#include <linux/sort.h>
+#include <linux/profile.h>
+#include <linux/notifier.h>
+#include <linux/moduleparam.h>
+#include <linux/cgroup.h>
+#include <linux/preempt.h>
+#include <linux/irq_work.h>
+#include <linux/capability.h>
+#include <linux/cred.h>
+#include <linux/spinlock.h>
 #include "mp3_given.h"
+#include "mp3_buffer.h"
 
-unsigned long mem_size = 512*1024;
+unsigned long mem_size = 512*1024;	// size of the ring of each CPU, set at load time or with "B"
+#define MP3_MIN_RING_SIZE (2 * PAGE_SIZE)	// header page and one page of records
+#define MP3_MAX_RING_SIZE (512UL << 20)		// 512 MB
 
 // CHAR DEVICE
 char memory_buf[12000];  // character device
 int open_dev(struct inode *inode, struct file *filep);
 int close_dev(struct inode *inode, struct file *filep);
 int mp3_mmap(struct file *filp, struct vm_area_struct *vma);
+unsigned int mp3_poll(struct file *filp, poll_table *wait);
+long mp3_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 ssize_t mp3_read(struct file *filp, char *buff, size_t len, loff_t *off);
+void mp3_vma_open(struct vm_area_struct *vma);
+void mp3_vma_close(struct vm_area_struct *vma);
 
 struct file_operations mp3_fops = {
     open  : open_dev,
     mmap  : mp3_mmap,
     read  : mp3_read,
+    poll  : mp3_poll,
+    unlocked_ioctl : mp3_ioctl,
     release : close_dev
 };
 
+struct vm_operations_struct mp3_vm_ops = {
+    open  : mp3_vma_open,
+    close : mp3_vma_close
+};
+atomic_t mp3_mappings = ATOMIC_INIT(0);	// live mappings of the buffer
+
+// READER (private data of every open file of the device)
+#define MP3_READ_BATCH (PAGE_SIZE / sizeof(struct mp3_record))	// records copied per copy_to_user
+struct mp3_reader
+{
+  int slot;				// consumer slot of the file
+  int next_ring;			// ring after which the next read starts
+  struct mutex lock;			// one read of the file at a time
+  struct mp3_record *bounce;		// MP3_READ_BATCH records copied out of a ring
+};
+pid_t consumer_pid[MP3_MAX_CONSUMERS];	// process that opened each slot
+unsigned long mp3_consumers;		// bit mask of the slots in use, changed under mp3_mutex
+
+// AGGREGATE (one counter of a task over the current window)
+struct mp3_agg
+{
+  unsigned long long sum;
+  unsigned long long max;
+};
+
 // PROCESS CONTROL BLOCK 
 struct mp3_task_struct
 {
   long pid;
+  pid_t tgid;				// process of the task
   struct task_struct* linux_task;	// the real PCB
   struct list_head task_node;
-  unsigned long cpu;
-  unsigned long maj;
-  unsigned long min;
+  struct list_head cpu_node;		// node in the task list of its sampler
+  int cpu_id;				// CPU that samples the task
+  unsigned long cpu;			// cpu time since registration in ns
+  unsigned long maj;			// major faults since registration
+  unsigned long min;			// minor faults since registration
+  unsigned long long last_time;		// time stamp of the last sample in ns
+  unsigned long last_min;		// counters of the task at the last sample
+  unsigned long last_maj;
+  unsigned long long last_runtime;
+  struct hlist_node hash_node;		// node in mp3_task_hash
+  unsigned long trace_every;		// trace 1 in trace_every faults, 0 = off
+  atomic_long_t trace_count;		// faults seen while tracing, counted by every CPU
+  struct mp3_heatmap *heat;		// fault heatmap, NULL = off
+  struct mm_struct *mm;			// address space, held while registered
+  unsigned long wss_cursor;		// next address of the working set scan
+  unsigned long wss_accessed;		// pages accessed in the current pass
+  unsigned long wss_scanned;		// present pages seen in the current pass
+  unsigned long long wss_start;		// start of the current pass in ns
+  unsigned long wss_pages;		// working set of the last complete pass
+  unsigned long lc_maj;			// counters seen by the last load check
+  unsigned long lc_cpu;
+  int suspended;			// stopped by the load control
+  unsigned long suspend_order;		// order of the suspension, last is resumed first
+  unsigned long pff_flt;		// faults seen by the last fault frequency check
+  unsigned long pff_rate;		// faults per second at the last check
+  unsigned long pff_allowance;		// memory allowance in pages, 0 = not set yet
+  unsigned long pff_lent;		// pages borrowed from the pool and not given back
+  struct mp3_agg agg[MP3_AGG_METRICS];	// counters of the current window
+  unsigned int agg_count;		// samples in the current window
+  unsigned long filter_maj;		// store a sample with at least this many major faults,
+  unsigned long filter_rate;		// ... or at least this many faults per second,
+  unsigned long filter_cpu;		// ... or at least this much cpu time in ns; all 0 = store all
+  unsigned long suppressed;		// samples not stored because of the filter
+  int exact;				// accounted at every context switch, not sampled
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+  struct preempt_notifier notifier;	// sched_in/sched_out of the task while exact
+#endif
+  unsigned long slice_min;		// counters of the task when its run started
+  unsigned long slice_maj;
+  unsigned long long slice_runtime;
+  unsigned long long slice_start;	// start of the run in ns
+  struct mp3_target *target;		// target the task was registered for, if any
+  unsigned long roll_min;		// counters at the last rollup of the target
+  unsigned long roll_maj;
+  unsigned long roll_cpu;
+  unsigned long roll_gen;		// rollup pass that counted the task last
+  struct rcu_head rcu;			// frees the task after unregistration
+  struct work_struct free_work;		// queued on mp3_free_wq
 };
+struct workqueue_struct *mp3_free_wq;	// frees the unregistered tasks, flushed at exit
+
+// PROFILING TARGETS (process trees and cgroups, registered task by task)
+#define MP3_TARGET_TREE   0		// a process and all its descendants
+#define MP3_TARGET_CGROUP 1		// every task in the memory cgroup of a process
+#define MP3_TARGET_BATCH 64		// tasks registered per scan pass
+#define TARGET_INTERVAL HZ		// rescan and rollup every second
+struct mp3_target
+{
+  struct list_head node;
+  int kind;				// MP3_TARGET_*
+  pid_t root;				// process the target was given by
+  struct cgroup_subsys_state *css;	// memory cgroup of a cgroup target, held
+  int nr_tasks;				// registered tasks of the target
+  pid_t failed[MP3_TARGET_BATCH];	// tasks that could not be registered, skipped until the next rescan
+  int nr_failed;
+  unsigned long long last_time;		// time of the last rollup in ns
+  unsigned long roll_gen;		// rollup passes so far
+};
+LIST_HEAD(mp3_target_list);		// also changed under mp3_mutex, for the readers
+static DEFINE_MUTEX(target_mutex);	// protects the targets, taken before mp3_mutex
+struct delayed_work target_work;	// periodic rescan and rollup
+struct work_struct target_scan_work;	// rescan after a fork
+int fork_entry(struct kprobe *kp, struct pt_regs *regs);
+struct kprobe fork_probe = {
+    symbol_name : "wake_up_new_task",
+    pre_handler : fork_entry
+};
+int fork_probed=0;
+
+// EXACT ACCOUNTING (one record per run of the task, from its context switches)
+#ifdef CONFIG_PREEMPT_NOTIFIERS
+void exact_sched_in(struct preempt_notifier *notifier, int cpu);
+void exact_sched_out(struct preempt_notifier *notifier, struct task_struct *next);
+struct preempt_ops exact_ops = {
+    sched_in : exact_sched_in,
+    sched_out : exact_sched_out
+};
+#endif
+int exact_task(struct mp3_task_struct *p, int on);
+int _sample_wanted(struct mp3_task_struct *p, unsigned long min, unsigned long maj, unsigned long cpu, unsigned long long interval);
+
+// LOAD CONTROL (suspend tasks while the registered tasks thrash)
+#define LC_INTERVAL HZ			// load check every second
+int lc_enabled=0;
+unsigned long lc_maj_rate = 100;	// major faults per second above which ...
+unsigned long lc_cpu_pct = 50;		// ... and cpu utilization below which they thrash
+struct delayed_work lc_work;
+unsigned long lc_order=0;		// suspensions so far, orders suspended tasks
+int lc_nr_suspended=0;
+unsigned long lc_suspends=0, lc_resumes=0;
+unsigned long lc_thrash_secs=0, lc_control_secs=0, lc_normal_secs=0;
+unsigned long long lc_thrash_cpu=0, lc_control_cpu=0, lc_normal_cpu=0;	// cpu ns used in each state
+void lc_handler(struct work_struct *work);
+void _lc_resume(struct mp3_task_struct *p);
+
+// PAGE FAULT FREQUENCY CONTROL (keep the fault rate of every task in a band)
+#define PFF_INTERVAL HZ			// fault frequency check every second
+#define PFF_MIN_PAGES 256		// smallest allowance and step (1 MB)
+int pff_enabled=0;
+unsigned long pff_upper = 1000;		// faults per second above which the allowance is raised ...
+unsigned long pff_lower = 100;		// ... and below which it is trimmed
+unsigned long pff_pool=0;		// pages that can still be lent to the tasks
+unsigned long pff_raises=0, pff_trims=0;
+unsigned long pff_starved=0;		// raises refused, the pool was empty
+struct delayed_work pff_work;
+static struct proc_dir_entry *pff_file;
+void _pff_release(struct mp3_task_struct *p);
+
+// WORKING SET ESTIMATION
+unsigned long wss_pages_per_tick = 1024;	// page table slots scanned per task per tick, 0 = off
+
+// FAULT HEATMAP (per task fault counts by VMA and address range)
+#define MP3_HEAT_BUCKETS 512
+#define MP3_HEAT_NAME 24
+#define MP3_HEAT_DEFAULT_KB 2048	// default range granularity (2 MB)
+
+#define MP3_VMA_ANON  0
+#define MP3_VMA_HEAP  1
+#define MP3_VMA_STACK 2
+#define MP3_VMA_FILE  3
+
+struct mp3_heat_bucket
+{
+  unsigned long start;			// first address of the range
+  unsigned long vm_start;		// VMA the range belongs to
+  unsigned long vm_end;
+  unsigned long minor;			// faults in the range
+  unsigned long major;
+  int kind;				// MP3_VMA_*
+  int used;
+  char name[MP3_HEAT_NAME];		// file name of a file mapping
+};
+
+struct mp3_heatmap
+{
+  spinlock_t lock;			// protects the buckets and the overflow count
+  unsigned int shift;			// log2 of the range granularity
+  unsigned long overflow;		// faults that found no free bucket
+  struct mp3_heat_bucket buckets[MP3_HEAT_BUCKETS];
+};
+static struct proc_dir_entry *heatmap_file;
+
+// TASK HASH (lookup by PID from the fault path, under RCU)
+#define MP3_HASH_BITS 8
+struct hlist_head mp3_task_hash[1 << MP3_HASH_BITS];
+
+// FAULT TRACING
+#define MP3_STAGE_SIZE 256		// staged fault records per CPU
+#define MP3_STAGE_BATCH 32		// staged records that wake the thread
+// arguments of handle_mm_fault(mm, vma, address, flags) at the entry probe;
+// the probe is only registered where they are known
+#ifdef CONFIG_X86_64
+#define MP3_FAULT_PROBE 1
+#define MP3_FAULT_VMA(regs) ((struct vm_area_struct *) (regs)->si)
+#define MP3_FAULT_ADDRESS(regs) ((regs)->dx)
+#else
+#define MP3_FAULT_VMA(regs) NULL
+#define MP3_FAULT_ADDRESS(regs) 0UL
+#endif
+struct mp3_fault_data
+{
+  unsigned long address;
+  unsigned long ip;
+  struct vm_area_struct *vma;
+  unsigned long long start;
+  int trace;				// emit a fault record
+};
+int fault_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int fault_return(struct kretprobe_instance *ri, struct pt_regs *regs);
+void _heat_add(struct mp3_heatmap *h, struct vm_area_struct *vma, unsigned long address, int major);
+struct kretprobe fault_probe = {
+    handler : fault_return,
+    entry_handler : fault_entry,
+    data_size : sizeof(struct mp3_fault_data),
+    maxactive : 64,
+    kp : {
+      symbol_name : "handle_mm_fault"
+    }
+};
+int nr_probed=0;	// tasks traced or with a heatmap, the probe is registered while > 0
 
 //PROC FILESYSTEM ENTRIES
 static struct proc_dir_entry *mp3_proc_dir;
 static struct proc_dir_entry *register_task_file;
+static struct proc_dir_entry *stats_file;
+
+// TASK EXIT NOTIFICATION
+int task_exit_notify(struct notifier_block *self, unsigned long val, void *data);
+struct notifier_block task_exit_nb = {
+    notifier_call : task_exit_notify
+};
+unsigned long reaped_count=0;	// registered tasks removed because they exited
+struct work_struct reap_work;		// unregisters the tasks missed by the notifier
+void reap_handler(struct work_struct *work);
+void _target_leave(struct mp3_task_struct *p);
 
 struct mp3_task_struct *mp3_current_task;
 
 // PROFILE BUFFER
 unsigned long *p_addr; 		// pointer to memory area 
-//unsigned long mem_size; // memory area size
+struct mp3_buffer_layout *p_layout;	// layout page at the start of p_addr
+unsigned long p_size;			// size of the memory area
+int p_contig=0;				// the area is physically contiguous
+int resize_buffer(unsigned long ring_size);
+
+// SAMPLING PERIOD
+#define MP3_MIN_PERIOD_US 100		// 100 microseconds
+#define MP3_MAX_PERIOD_US 10000000	// 10 seconds
+unsigned long sample_period = 50 * NSEC_PER_MSEC;	// in nanoseconds
+
+// AGGREGATION WINDOW (one summary per task and window instead of every sample)
+#define MP3_MAX_WINDOW_MS 60000		// 1 minute
+unsigned long agg_window = 0;		// in nanoseconds, 0 = every sample is a record
+
+// WATERMARK (when a consumer sleeping in poll is woken up)
+unsigned long wake_records = 64;	// unread records
+unsigned long wake_ms = 1000;		// age of the oldest unread record
+DECLARE_WAIT_QUEUE_HEAD(mp3_waitq);
+#define WAKE_INTERVAL (HZ / 10)		// age check while a consumer is open
+struct delayed_work wake_work;
+void wake_handler(struct work_struct *work);
+
+// PER-CPU SAMPLER
+struct mp3_cpu_sampler
+{
+  int cpu;
+  struct hrtimer timer;			// expires every sample_period
+  struct task_struct *thread;		// samples the tasks of this CPU
+  int pending;				// the timer expired, thread must sample
+  int drain;				// staged records wait for the thread
+  unsigned long long expected;		// expiry of the pending tick in ns
+  struct mutex lock;			// one writer of the ring at a time
+  struct list_head tasks;		// tasks assigned to this CPU, RCU list changed under mp3_mutex
+  int nr_tasks;
+  int nr_exact;				// tasks accounted at context switches
+  struct irq_work kick;			// wakes the thread from any context
+  struct mp3_buffer_header *header;	// header page of the ring of this CPU
+  struct mp3_record *records;		// record slots of the ring
+  // the state of the ring the kernel trusts; the ring header is mapped 
+  // writable to the consumers, so its copies are only exported
+  unsigned long head;			// records written
+  unsigned long capacity;		// number of record slots
+  int policy;				// MP3_OVERWRITE_OLDEST or MP3_DROP_NEWEST
+  unsigned long drops;			// records not written because the ring was full
+  unsigned long lost[MP3_MAX_CONSUMERS];	// records overwritten before a consumer read them
+  unsigned long long seq;		// next record sequence number
+  unsigned long ticks;			// samplings done
+  unsigned long missed;			// periods skipped by the timer or while the thread was busy
+  unsigned long long jitter_total;	// sum of the sampling delays in ns
+  unsigned long long jitter_max;	// longest sampling delay in ns
+  struct mp3_record *stage;		// staged records waiting for the thread
+  unsigned int nr_staged;
+  unsigned long stage_drops;		// records lost, the stage was full
+  unsigned long folded;			// samples folded into aggregation windows
+  unsigned long suppressed;		// samples not stored because of a filter
+  unsigned long failed;			// samples lost, the task could not be read
+};
+DEFINE_PER_CPU(struct mp3_cpu_sampler, mp3_samplers);
+void _start_timer(void *data);
 
-// workqueue
-struct delayed_work *wqueue;
-int queue_stop=0;	// determines when work should stop
 int list_count=0;       // keep track of the number of elements on list
-static unsigned long p_index=0;
 
 LIST_HEAD(mp3_task_list);
 static DEFINE_MUTEX(mp3_mutex);
@@ -0,0 +1,156 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+// MP3:		Virtual Memory Page Fault Measurement 
+// Name:        mp3_buffer.h
+// Date: 	11/5/2011
+// Group:	20: Intisar Malhi, Alexandra Mirtcheva, and Roberto Moreno
+// Description: This header describes the layout of the profiler buffer. It is
+//		shared by the kernel module (mp3.c) and the monitor, which 
+//		maps the buffer through the character device. 
+//
+///////////////////////////////////////////////////////////////////////////////
+#ifndef __MP3_BUFFER_INCLUDE__
+#define __MP3_BUFFER_INCLUDE__
+
+// RECORD FORMAT
+//
+// Every slot of a ring holds one fixed size record. The layout page tells
+// the format version and the record size, so a reader can reject a buffer
+// it does not understand. New record types only add members to the union.
+#define MP3_FORMAT_VERSION 3
+
+#define MP3_RECORD_SAMPLE 1	// periodic counters of one task
+#define MP3_RECORD_FAULT  2	// one traced page fault of one task
+#define MP3_RECORD_WSS    3	// working set of one task, once per scan pass
+#define MP3_RECORD_PFF    4	// memory allowance change of one task
+#define MP3_RECORD_AGG    5	// counters of one task over an aggregation window
+#define MP3_RECORD_SLICE  6	// counters of one task over one run on a CPU, as a sample
+#define MP3_RECORD_ROLLUP 7	// counters of the threads of one process of a target, as a 
+				// sample; pid is the process, tid its number of registered 
+				// threads, 0 in the last record once it left the target
+
+#define MP3_FAULT_MAJOR 0x1	// the fault needed I/O
+#define MP3_FAULT_ERROR 0x2	// the fault could not be handled
+
+// counters folded into an aggregation window, one value per sample
+#define MP3_AGG_MIN_FLT  0	// minor faults
+#define MP3_AGG_MAJ_FLT  1	// major faults
+#define MP3_AGG_CPU_TIME 2	// cpu time in ns
+#define MP3_AGG_INTERVAL 3	// time since the previous sample in ns; the sum is the window
+#define MP3_AGG_METRICS  4
+
+#define MP3_PFF_HOLD     0x0	// the allowance did not change
+#define MP3_PFF_RAISE    0x1	// the fault rate was above the band
+#define MP3_PFF_TRIM     0x2	// the fault rate was below the band
+
+struct mp3_record
+{
+  unsigned short type;		// MP3_RECORD_*
+  unsigned short size;		// sizeof(struct mp3_record)
+  unsigned int cpu;		// CPU that wrote the record
+  int pid;			// thread group id of the task
+  int tid;			// thread id of the task
+  unsigned long long seq;	// sequence number in the ring, gaps are drops
+  unsigned long long time;	// monotonic time stamp in nanoseconds
+  union
+  {
+    struct
+    {
+      unsigned long long min_flt;	// minor faults in the interval
+      unsigned long long maj_flt;	// major faults in the interval
+      unsigned long long cpu_time;	// cpu time used in the interval in ns
+      unsigned long long interval;	// length of the interval in nanoseconds
+    } sample;				// also the payload of MP3_RECORD_SLICE
+    struct
+    {
+      unsigned long long address;	// faulting address
+      unsigned long long ip;		// user instruction pointer
+      unsigned long long latency;	// time to handle the fault in ns
+      unsigned long long flags;		// MP3_FAULT_*
+    } fault;
+    struct
+    {
+      unsigned long long pages;		// pages accessed during the pass
+      unsigned long long scanned;	// present pages scanned in the pass
+      unsigned long long rss;		// resident pages at the end of the pass
+      unsigned long long duration;	// length of the pass in nanoseconds
+    } wss;
+    struct
+    {
+      unsigned long long allowance;	// new memory allowance in pages
+      unsigned long long rate;		// faults per second that led to it
+      unsigned long long rss;		// resident pages of the task
+      unsigned long long decision;	// MP3_PFF_*
+    } pff;
+    struct
+    {
+      unsigned int count;		// samples in the window
+      unsigned int window_us;		// length of the window in us
+      unsigned int min_flt;		// minor faults in the window
+      unsigned int min_flt_max;		// most minor faults of one sample
+      unsigned int maj_flt;		// major faults in the window
+      unsigned int maj_flt_max;		// most major faults of one sample
+      unsigned int cpu_us;		// cpu time used in the window in us
+      unsigned int cpu_us_max;		// most cpu time of one sample in us
+    } agg;				// the values saturate at 2^32 - 1
+    unsigned long long words[4];
+  } u;
+};
+
+// OVERFLOW POLICY (what the producer does when the ring is full)
+#define MP3_OVERWRITE_OLDEST 0	// keep sampling, the oldest samples are lost
+#define MP3_DROP_NEWEST      1	// keep the unread samples, count the new ones as drops
+
+// CONSUMERS
+//
+// Every open file of the device is a consumer with its own slot. The slot
+// of a file is returned by the MP3_IOC_CONSUMER ioctl; the consumer only
+// reads and writes tail[slot] of the rings, so consumers do not disturb
+// each other.
+#define MP3_MAX_CONSUMERS 8
+#define MP3_IOC_CONSUMER _IO('m', 1)
+
+// LAYOUT PAGE (first page of the buffer)
+//
+// Every CPU samples its own tasks into its own ring. Ring i starts at
+// ring_offset + i * ring_size with a header page, followed by its records.
+// A reader merges the rings by the time stamp of the records.
+#define MP3_BUFFER_MAGIC 0x4d503342	// "MP3B"
+
+struct mp3_buffer_layout
+{
+  unsigned long magic;		// MP3_BUFFER_MAGIC
+  unsigned long version;	// MP3_FORMAT_VERSION
+  unsigned long record_size;	// sizeof(struct mp3_record)
+  unsigned long nr_rings;	// one ring per possible CPU
+  unsigned long ring_offset;	// offset of the first ring in bytes
+  unsigned long ring_size;	// bytes from one ring to the next
+  unsigned long consumers;	// bit mask of the slots in use (a copy, the kernel keeps its own)
+};
+
+// RING HEADER (first page of every ring)
+//
+// The kernel keeps its own copy of everything but the tails and only 
+// exports it here; writing these fields changes nothing in the kernel. 
+// head and the tails are free running record counters; the slot of record
+// n is n % capacity. Only the sampling thread writes head and only the
+// consumer of a slot writes its tail, so head - tail[slot] is the lag of 
+// that consumer. The producer fills the slot before it publishes the new
+// head, so a reader that sees head must read it before the records (read
+// barrier). With MP3_OVERWRITE_OLDEST a slot can be rewritten while it is
+// being read: the reader re-checks head after the copy and discards 
+// records older than head - capacity. With MP3_DROP_NEWEST the slowest
+// consumer decides when the ring is full.
+struct mp3_buffer_header
+{
+  unsigned long head;		// records written by the sampling thread
+  unsigned long capacity;	// number of record slots in the ring
+  unsigned long data_offset;	// offset of the records from the ring header
+  unsigned long policy;		// MP3_OVERWRITE_OLDEST or MP3_DROP_NEWEST
+  unsigned long drops;		// records not written because the ring was full
+  unsigned long tail[MP3_MAX_CONSUMERS];	// records consumed, per consumer
+  unsigned long lost[MP3_MAX_CONSUMERS];	// records overwritten before the
+						// consumer read them
+};
+
+#endif
@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define N_ITERATION 20
 
@@ -39,6 +40,21 @@ int local_access(int addr)
   }
 }
 
+// This function sends one command to the MP3 kernel module. The proc file is written from this thread, so the module sees the task itself as the writer (exact accounting needs it).
+void mp3_command(char *cmd)
+{
+  int fd;
+
+  fd = open("/proc/mp3/status", O_WRONLY);
+  if(fd < 0){
+    perror("/proc/mp3/status");
+    return;
+  }
+  if(write(fd, cmd, strlen(cmd)) < 0)
+    perror("/proc/mp3/status");
+  close(fd);
+}
+
 int main(int argc, char* argv[])
 {
   char cmd[120];
@@ -46,9 +62,10 @@ int main(int argc, char* argv[])
   int i, j, k;
   int locality;
   int naccess;
+  int exact;
 
   if(argc<4){
-    printf("usage: work <memsize in MB> <locality: R for Random or T for Temporal> <# of memory accesses per iteration>");
+    printf("usage: work <memsize in MB> <locality: R for Random or T for Temporal> <# of memory accesses per iteration> [X for exact accounting]");
     return -1;
   }
 
@@ -66,12 +83,18 @@ int main(int argc, char* argv[])
     return -1;
   }
 
+  exact = (argc > 4 && argv[4][0]=='X');
+
   printf("A work prcess starts (configuration: %d %d %d)\n", msize, locality, naccess); 
 
   // 1. Register itself to the MP3 kernel module for profiling.
   mypid = syscall(__NR_gettid);
-  sprintf(cmd, "echo 'R %u'>//proc/mp3/status", mypid);
-  system(cmd);
+  sprintf(cmd, "R %u\n", mypid);
+  mp3_command(cmd);
+  if(exact){
+    sprintf(cmd, "X %u 1\n", mypid);
+    mp3_command(cmd);
+  }
 
   // 2. Allocate memory blocks
   for(i=0; i<msize; i++){
@@ -113,7 +136,7 @@ int main(int argc, char* argv[])
   }
 
   // 5. Unregister itself to stop the profiling
-  sprintf(cmd, "echo 'U %u'>//proc/mp3/status", mypid);
-  system(cmd);
+  sprintf(cmd, "U %u\n", mypid);
+  mp3_command(cmd);
 }
 